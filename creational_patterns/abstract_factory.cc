@@ -1,5 +1,13 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <new>
 #include <string>
+#include <vector>
 /**
  * Each distinct product of a product family should have a base interface. All
  * variants of the product must implement this interface.
@@ -8,22 +16,30 @@ class AbstractProductA {
  public:
   virtual ~AbstractProductA(){};
   virtual std::string UsefulFunctionA() const = 0;
+  /**
+   * A cheap variant of the useful function, so that the cost of calling it is
+   * not hidden behind building a string.
+   */
+  virtual int UsefulValueA() const = 0;
 };
 
 /**
  * Concrete Products are created by corresponding Concrete Factories.
  */
-class ConcreteProductA1 : public AbstractProductA {
+class ConcreteProductA1 final : public AbstractProductA {
  public:
   std::string UsefulFunctionA() const override {
     return "The result of the product A1.";
   }
+  int UsefulValueA() const override { return 1; }
 };
 
-class ConcreteProductA2 : public AbstractProductA {
+class ConcreteProductA2 final : public AbstractProductA {
+ public:
   std::string UsefulFunctionA() const override {
     return "The result of the product A2.";
   }
+  int UsefulValueA() const override { return 2; }
 };
 
 /**
@@ -46,12 +62,14 @@ class AbstractProductB {
    */
   virtual std::string AnotherUsefulFunctionB(
       const AbstractProductA &collaborator) const = 0;
+  virtual int AnotherUsefulValueB(const AbstractProductA &collaborator,
+                                  int seed) const = 0;
 };
 
 /**
  * Concrete Products are created by corresponding Concrete Factories.
  */
-class ConcreteProductB1 : public AbstractProductB {
+class ConcreteProductB1 final : public AbstractProductB {
  public:
   std::string UsefulFunctionB() const override {
     return "The result of the product B1.";
@@ -66,9 +84,19 @@ class ConcreteProductB1 : public AbstractProductB {
     const std::string result = collaborator.UsefulFunctionA();
     return "The result of the B1 collaborating with ( " + result + " )";
   }
+  int AnotherUsefulValueB(const AbstractProductA &collaborator,
+                          int seed) const override {
+    return AnotherUsefulValueB(collaborator.UsefulValueA(), seed);
+  }
+  /**
+   * The same collaboration when the collaborator's value is already known.
+   */
+  int AnotherUsefulValueB(int collaborator_value, int seed) const {
+    return seed * 10 + collaborator_value;
+  }
 };
 
-class ConcreteProductB2 : public AbstractProductB {
+class ConcreteProductB2 final : public AbstractProductB {
  public:
   std::string UsefulFunctionB() const override {
     return "The result of the product B2.";
@@ -83,6 +111,95 @@ class ConcreteProductB2 : public AbstractProductB {
     const std::string result = collaborator.UsefulFunctionA();
     return "The result of the B2 collaborating with ( " + result + " )";
   }
+  int AnotherUsefulValueB(const AbstractProductA &collaborator,
+                          int seed) const override {
+    return AnotherUsefulValueB(collaborator.UsefulValueA(), seed);
+  }
+  /**
+   * The same collaboration when the collaborator's value is already known.
+   */
+  int AnotherUsefulValueB(int collaborator_value, int seed) const {
+    return seed * 20 + collaborator_value;
+  }
+};
+
+/**
+ * Creating products one at a time scatters them all over the heap, and every
+ * later call has to chase a pointer and go through a vtable. A batch keeps a
+ * whole block of products of one variant next to each other and exposes
+ * operations over the whole block, so a single virtual call covers the batch.
+ *
+ * Our products carry no data of their own, so a block is simply a contiguous
+ * array of concrete products; batch operations write their results into
+ * caller-provided columns (one array per result), which is the
+ * structure-of-arrays layout later loops can stream through.
+ */
+class ProductBatchA {
+ public:
+  virtual ~ProductBatchA() {}
+  virtual size_t size() const = 0;
+  virtual const AbstractProductA &operator[](size_t index) const = 0;
+  /**
+   * Writes UsefulValueA() of every product into out[0..size()).
+   */
+  virtual void UsefulValuesA(int *out) const = 0;
+};
+
+class ProductBatchB {
+ public:
+  virtual ~ProductBatchB() {}
+  virtual size_t size() const = 0;
+  virtual const AbstractProductB &operator[](size_t index) const = 0;
+  /**
+   * out[i] = (*this)[i].AnotherUsefulValueB(collaborators[i], seeds[i]).
+   * Both batches must have the same size.
+   */
+  virtual void AnotherUsefulValuesB(const ProductBatchA &collaborators,
+                                    const int *seeds, int *out) const = 0;
+};
+
+/**
+ * Each family gets its own block type by instantiating these templates with
+ * its concrete products. The concrete products are final, so calls inside the
+ * loops are resolved statically.
+ */
+template <typename ConcreteProductA>
+class ProductBlockA : public ProductBatchA {
+ private:
+  std::vector<ConcreteProductA> products_;
+
+ public:
+  explicit ProductBlockA(size_t count) : products_(count) {}
+  size_t size() const override { return products_.size(); }
+  const AbstractProductA &operator[](size_t index) const override {
+    return products_[index];
+  }
+  void UsefulValuesA(int *out) const override {
+    for (size_t i = 0; i < products_.size(); i++) {
+      out[i] = products_[i].UsefulValueA();
+    }
+  }
+};
+
+template <typename ConcreteProductB>
+class ProductBlockB : public ProductBatchB {
+ private:
+  std::vector<ConcreteProductB> products_;
+
+ public:
+  explicit ProductBlockB(size_t count) : products_(count) {}
+  size_t size() const override { return products_.size(); }
+  const AbstractProductB &operator[](size_t index) const override {
+    return products_[index];
+  }
+  void AnotherUsefulValuesB(const ProductBatchA &collaborators,
+                            const int *seeds, int *out) const override {
+    assert(collaborators.size() == products_.size());
+    collaborators.UsefulValuesA(out);
+    for (size_t i = 0; i < products_.size(); i++) {
+      out[i] = products_[i].AnotherUsefulValueB(out[i], seeds[i]);
+    }
+  }
 };
 
 /**
@@ -95,8 +212,17 @@ class ConcreteProductB2 : public AbstractProductB {
  */
 class AbstractFactory {
  public:
+  virtual ~AbstractFactory() {}
   virtual AbstractProductA *CreateProductA() const = 0;
   virtual AbstractProductB *CreateProductB() const = 0;
+  /**
+   * Bulk versions of the methods above: they create `count` products of the
+   * factory's variant in a single contiguous block.
+   */
+  virtual std::unique_ptr<ProductBatchA> CreateProductsA(
+      size_t count) const = 0;
+  virtual std::unique_ptr<ProductBatchB> CreateProductsB(
+      size_t count) const = 0;
 };
 
 /**
@@ -113,6 +239,14 @@ class ConcreteFactory1 : public AbstractFactory {
   AbstractProductB *CreateProductB() const override {
     return new ConcreteProductB1();
   }
+  std::unique_ptr<ProductBatchA> CreateProductsA(size_t count) const override {
+    return std::unique_ptr<ProductBatchA>(
+        new ProductBlockA<ConcreteProductA1>(count));
+  }
+  std::unique_ptr<ProductBatchB> CreateProductsB(size_t count) const override {
+    return std::unique_ptr<ProductBatchB>(
+        new ProductBlockB<ConcreteProductB1>(count));
+  }
 };
 
 /**
@@ -126,6 +260,14 @@ class ConcreteFactory2 : public AbstractFactory {
   AbstractProductB *CreateProductB() const override {
     return new ConcreteProductB2();
   }
+  std::unique_ptr<ProductBatchA> CreateProductsA(size_t count) const override {
+    return std::unique_ptr<ProductBatchA>(
+        new ProductBlockA<ConcreteProductA2>(count));
+  }
+  std::unique_ptr<ProductBatchB> CreateProductsB(size_t count) const override {
+    return std::unique_ptr<ProductBatchB>(
+        new ProductBlockB<ConcreteProductB2>(count));
+  }
 };
 
 /**
@@ -143,7 +285,394 @@ void ClientCode(const AbstractFactory &factory) {
   delete product_b;
 }
 
-int main() {
+/**
+ * Creating every product with `new` and throwing it away with `delete` right
+ * after use costs two trips to the heap per product. When products live only
+ * for the duration of a request, it's cheaper to carve them out of an arena
+ * and give the whole arena back at once.
+ *
+ * The ProductArena hands out memory from a few large blocks. Products are still
+ * destroyed one by one through their handles, but their memory is only
+ * reclaimed in bulk by Reset(). The blocks are kept, so a warmed-up arena never
+ * touches the heap again. A product too large for a block gets a block of its
+ * own, which Reset() frees.
+ */
+class ProductArena {
+ private:
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  std::vector<std::unique_ptr<char[]>> large_blocks_;
+  size_t block_size_;
+  size_t current_ = 0;
+  size_t offset_ = 0;
+  size_t live_ = 0;
+
+ public:
+  explicit ProductArena(size_t block_size = 4096) : block_size_(block_size) {}
+  ProductArena(const ProductArena &) = delete;
+  ProductArena &operator=(const ProductArena &) = delete;
+  ~ProductArena() { assert(live_ == 0 && "products outlived their arena"); }
+
+  void *Allocate(size_t size, size_t alignment) {
+    if (size + alignment > block_size_) {
+      // Memory from new[] is aligned for any type with default alignment.
+      large_blocks_.emplace_back(new char[size]);
+      ++live_;
+      return large_blocks_.back().get();
+    }
+    size_t offset = (offset_ + alignment - 1) & ~(alignment - 1);
+    if (blocks_.empty() || offset + size > block_size_) {
+      if (!blocks_.empty()) {
+        ++current_;
+      }
+      if (current_ == blocks_.size()) {
+        blocks_.emplace_back(new char[block_size_]);
+      }
+      offset = 0;
+    }
+    offset_ = offset + size;
+    ++live_;
+    return blocks_[current_].get() + offset;
+  }
+
+  void Release() { --live_; }
+
+  /**
+   * Gives every byte back at once. All handles must be gone by then.
+   */
+  void Reset() {
+    assert(live_ == 0 && "Reset() called with live products");
+    large_blocks_.clear();
+    current_ = 0;
+    offset_ = 0;
+  }
+};
+
+/**
+ * Arena products are returned as owning handles: the deleter runs the
+ * product's destructor but leaves the memory to the arena.
+ */
+struct ArenaDeleter {
+  ProductArena *arena;
+  template <typename T>
+  void operator()(T *product) const {
+    product->~T();
+    arena->Release();
+  }
+};
+
+template <typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaDeleter>;
+
+template <typename Base, typename Concrete>
+ArenaPtr<Base> MakeInArena(ProductArena &arena) {
+  void *memory = arena.Allocate(sizeof(Concrete), alignof(Concrete));
+  return ArenaPtr<Base>(new (memory) Concrete(), ArenaDeleter{&arena});
+}
+
+/**
+ * The arena-aware factory mirrors AbstractFactory, except that the caller
+ * decides where the family's products live. A per-request arena keeps all the
+ * products of one request next to each other.
+ */
+class ArenaAbstractFactory {
+ public:
+  virtual ~ArenaAbstractFactory() {}
+  virtual ArenaPtr<AbstractProductA> CreateProductA(
+      ProductArena &arena) const = 0;
+  virtual ArenaPtr<AbstractProductB> CreateProductB(
+      ProductArena &arena) const = 0;
+};
+
+class ArenaConcreteFactory1 : public ArenaAbstractFactory {
+ public:
+  ArenaPtr<AbstractProductA> CreateProductA(
+      ProductArena &arena) const override {
+    return MakeInArena<AbstractProductA, ConcreteProductA1>(arena);
+  }
+  ArenaPtr<AbstractProductB> CreateProductB(
+      ProductArena &arena) const override {
+    return MakeInArena<AbstractProductB, ConcreteProductB1>(arena);
+  }
+};
+
+class ArenaConcreteFactory2 : public ArenaAbstractFactory {
+ public:
+  ArenaPtr<AbstractProductA> CreateProductA(
+      ProductArena &arena) const override {
+    return MakeInArena<AbstractProductA, ConcreteProductA2>(arena);
+  }
+  ArenaPtr<AbstractProductB> CreateProductB(
+      ProductArena &arena) const override {
+    return MakeInArena<AbstractProductB, ConcreteProductB2>(arena);
+  }
+};
+
+/**
+ * The client code looks just the same, but no longer frees anything by hand.
+ */
+void ClientCode(const ArenaAbstractFactory &factory, ProductArena &arena) {
+  ArenaPtr<AbstractProductA> product_a = factory.CreateProductA(arena);
+  ArenaPtr<AbstractProductB> product_b = factory.CreateProductB(arena);
+  std::cout << product_b->UsefulFunctionB() << "\n";
+  std::cout << product_b->AnotherUsefulFunctionB(*product_a) << "\n";
+}
+
+/**
+ * When the family is picked once at startup, it doesn't have to be a runtime
+ * decision at all. Here the family is a compile-time parameter: products are
+ * plain classes without virtual functions, so calls between them can be
+ * inlined.
+ *
+ * The rule that B1 only works with A1 is now checked by the compiler: each B
+ * product only accepts the A product of its own family, so mixing variants
+ * fails to compile instead of misbehaving at runtime.
+ */
+class StaticProductA1 {
+ public:
+  std::string UsefulFunctionA() const {
+    return "The result of the product A1.";
+  }
+  int UsefulValueA() const { return 1; }
+};
+
+class StaticProductA2 {
+ public:
+  std::string UsefulFunctionA() const {
+    return "The result of the product A2.";
+  }
+  int UsefulValueA() const { return 2; }
+};
+
+class StaticProductB1 {
+ public:
+  std::string UsefulFunctionB() const {
+    return "The result of the product B1.";
+  }
+  std::string AnotherUsefulFunctionB(
+      const StaticProductA1 &collaborator) const {
+    const std::string result = collaborator.UsefulFunctionA();
+    return "The result of the B1 collaborating with ( " + result + " )";
+  }
+  int AnotherUsefulValueB(const StaticProductA1 &collaborator, int seed) const {
+    return seed * 10 + collaborator.UsefulValueA();
+  }
+};
+
+class StaticProductB2 {
+ public:
+  std::string UsefulFunctionB() const {
+    return "The result of the product B2.";
+  }
+  std::string AnotherUsefulFunctionB(
+      const StaticProductA2 &collaborator) const {
+    const std::string result = collaborator.UsefulFunctionA();
+    return "The result of the B2 collaborating with ( " + result + " )";
+  }
+  int AnotherUsefulValueB(const StaticProductA2 &collaborator, int seed) const {
+    return seed * 20 + collaborator.UsefulValueA();
+  }
+};
+
+/**
+ * A family is just a list of product types that belong together.
+ */
+struct Family1 {
+  using ProductA = StaticProductA1;
+  using ProductB = StaticProductB1;
+};
+
+struct Family2 {
+  using ProductA = StaticProductA2;
+  using ProductB = StaticProductB2;
+};
+
+/**
+ * The static factory plays the role of AbstractFactory for a family chosen at
+ * compile time. Products are returned by value; there's nothing to free.
+ */
+template <typename Family>
+class StaticFactory {
+ public:
+  using ProductA = typename Family::ProductA;
+  using ProductB = typename Family::ProductB;
+
+  ProductA CreateProductA() const { return ProductA(); }
+  ProductB CreateProductB() const { return ProductB(); }
+};
+
+template <typename Family>
+void ClientCode(const StaticFactory<Family> &factory) {
+  const auto product_a = factory.CreateProductA();
+  const auto product_b = factory.CreateProductB();
+  std::cout << product_b.UsefulFunctionB() << "\n";
+  std::cout << product_b.AnotherUsefulFunctionB(product_a) << "\n";
+}
+
+/**
+ * Calls the collaborating functions of both versions in a tight loop, so the
+ * cost of the virtual calls shows up next to the inlined ones.
+ */
+void BenchmarkDispatch(const AbstractFactory &factory) {
+  const int kIterations = 100000000;
+  // Inputs come from memory filled at runtime, so neither loop can be folded
+  // into a closed form by the compiler.
+  const int kSeeds = 4096;
+  std::vector<int> seeds(kSeeds);
+  uint32_t random = static_cast<uint32_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  for (int &seed : seeds) {
+    random = random * 1664525u + 1013904223u;
+    seed = static_cast<int>(random >> 8);
+  }
+  const AbstractProductA *product_a = factory.CreateProductA();
+  const AbstractProductB *product_b = factory.CreateProductB();
+  long long sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i++) {
+    sum += product_b->AnotherUsefulValueB(*product_a, seeds[i % kSeeds]);
+  }
+  std::chrono::duration<double> virtual_time =
+      std::chrono::steady_clock::now() - start;
+  delete product_a;
+  delete product_b;
+
+  StaticFactory<Family1> static_factory;
+  const auto static_a = static_factory.CreateProductA();
+  const auto static_b = static_factory.CreateProductB();
+  long long static_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i++) {
+    static_sum += static_b.AnotherUsefulValueB(static_a, seeds[i % kSeeds]);
+  }
+  std::chrono::duration<double> static_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "virtual: " << virtual_time.count() * 1e9 / kIterations
+            << " ns/call\n";
+  std::cout << "static:  " << static_time.count() * 1e9 / kIterations
+            << " ns/call\n";
+  std::cout << "(checksums " << sum << ", " << static_sum << ")\n";
+}
+
+/**
+ * The batch client works on whole blocks instead of single products.
+ */
+void BatchClientCode(const AbstractFactory &factory) {
+  const size_t kCount = 4;
+  std::unique_ptr<ProductBatchA> products_a = factory.CreateProductsA(kCount);
+  std::unique_ptr<ProductBatchB> products_b = factory.CreateProductsB(kCount);
+  std::vector<int> seeds = {1, 2, 3, 4};
+  std::vector<int> results(kCount);
+  products_b->AnotherUsefulValuesB(*products_a, seeds.data(), results.data());
+  std::cout << (*products_b)[0].AnotherUsefulFunctionB((*products_a)[0])
+            << "\n";
+  std::cout << "Batch results:";
+  for (int result : results) {
+    std::cout << " " << result;
+  }
+  std::cout << "\n";
+}
+
+/**
+ * Creates a large number of families and evaluates every pair once, first one
+ * product at a time and then as batches.
+ */
+void BenchmarkBatches(const AbstractFactory &factory) {
+  const size_t kCount = 1000000;
+  std::vector<int> seeds(kCount);
+  for (size_t i = 0; i < kCount; i++) {
+    seeds[i] = static_cast<int>(i);
+  }
+  std::vector<int> results(kCount);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<AbstractProductA *> products_a(kCount);
+  std::vector<AbstractProductB *> products_b(kCount);
+  for (size_t i = 0; i < kCount; i++) {
+    products_a[i] = factory.CreateProductA();
+    products_b[i] = factory.CreateProductB();
+  }
+  for (size_t i = 0; i < kCount; i++) {
+    results[i] = products_b[i]->AnotherUsefulValueB(*products_a[i], seeds[i]);
+  }
+  for (size_t i = 0; i < kCount; i++) {
+    delete products_a[i];
+    delete products_b[i];
+  }
+  std::chrono::duration<double> single_time =
+      std::chrono::steady_clock::now() - start;
+  long long single_sum = 0;
+  for (int result : results) {
+    single_sum += result;
+  }
+
+  start = std::chrono::steady_clock::now();
+  {
+    std::unique_ptr<ProductBatchA> batch_a = factory.CreateProductsA(kCount);
+    std::unique_ptr<ProductBatchB> batch_b = factory.CreateProductsB(kCount);
+    batch_b->AnotherUsefulValuesB(*batch_a, seeds.data(), results.data());
+  }
+  std::chrono::duration<double> batch_time =
+      std::chrono::steady_clock::now() - start;
+  long long batch_sum = 0;
+  for (int result : results) {
+    batch_sum += result;
+  }
+
+  std::cout << "one at a time: " << kCount / single_time.count()
+            << " families/s\n";
+  std::cout << "batched:       " << kCount / batch_time.count()
+            << " families/s\n";
+  std::cout << "(checksums " << single_sum << ", " << batch_sum << ")\n";
+}
+
+/**
+ * Compares how many products per second each path can create and release.
+ * The arena is reset after every simulated request of kRequestSize families.
+ */
+void BenchmarkAllocations() {
+  const int kIterations = 1000000;
+  const int kRequestSize = 64;
+  uintptr_t sink = 0;
+
+  ConcreteFactory1 heap_factory;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i++) {
+    AbstractProductA *product_a = heap_factory.CreateProductA();
+    AbstractProductB *product_b = heap_factory.CreateProductB();
+    sink += reinterpret_cast<uintptr_t>(product_a) +
+            reinterpret_cast<uintptr_t>(product_b);
+    delete product_a;
+    delete product_b;
+  }
+  std::chrono::duration<double> heap_time =
+      std::chrono::steady_clock::now() - start;
+
+  ArenaConcreteFactory1 arena_factory;
+  ProductArena arena;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i += kRequestSize) {
+    for (int j = 0; j < kRequestSize; j++) {
+      ArenaPtr<AbstractProductA> product_a =
+          arena_factory.CreateProductA(arena);
+      ArenaPtr<AbstractProductB> product_b =
+          arena_factory.CreateProductB(arena);
+      sink += reinterpret_cast<uintptr_t>(product_a.get()) +
+              reinterpret_cast<uintptr_t>(product_b.get());
+    }
+    arena.Reset();
+  }
+  std::chrono::duration<double> arena_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "new/delete: " << 2 * kIterations / heap_time.count()
+            << " allocations/s\n";
+  std::cout << "arena:      " << 2 * kIterations / arena_time.count()
+            << " allocations/s\n";
+  std::cout << "(checksum " << ((sink >> 4) & 0xff) << ")\n";
+}
+
+int main(int argc, char *argv[]) {
   std::cout << "Client: Testing client code with the first factory type:\n";
   ConcreteFactory1 *f1 = new ConcreteFactory1();
   ClientCode(*f1);
@@ -154,5 +683,44 @@ int main() {
   ConcreteFactory2 *f2 = new ConcreteFactory2();
   ClientCode(*f2);
   delete f2;
+  std::cout << std::endl;
+
+  std::cout
+      << "Client: Testing the client code with an arena-backed factory:\n";
+  ProductArena arena;
+  ClientCode(ArenaConcreteFactory1(), arena);
+  ClientCode(ArenaConcreteFactory2(), arena);
+  arena.Reset();
+  std::cout << std::endl;
+
+  std::cout << "Benchmark: creating product families on the heap vs. in an "
+               "arena:\n";
+  BenchmarkAllocations();
+  std::cout << std::endl;
+
+  std::cout << "Client: Testing the client code with compile-time families:\n";
+  ClientCode(StaticFactory<Family1>());
+  ClientCode(StaticFactory<Family2>());
+  std::cout << std::endl;
+
+  std::cout << "Benchmark: virtual vs. static dispatch between products:\n";
+  // The family is picked at runtime from the command line ("2" selects the
+  // second one), just like in a real application, so the compiler can't see
+  // through the virtual calls.
+  bool second_family = argc > 1 && std::string(argv[1]) == "2";
+  std::unique_ptr<AbstractFactory> factory(
+      second_family ? static_cast<AbstractFactory *>(new ConcreteFactory2())
+                    : new ConcreteFactory1());
+  BenchmarkDispatch(*factory);
+  std::cout << std::endl;
+
+  std::cout << "Client: Testing the batch client code with both factories:\n";
+  BatchClientCode(ConcreteFactory1());
+  BatchClientCode(ConcreteFactory2());
+  std::cout << std::endl;
+
+  std::cout << "Benchmark: creating and using products one at a time vs. in "
+               "batches:\n";
+  BenchmarkBatches(*factory);
   return 0;
 }
\ No newline at end of file
@@ -7,16 +7,57 @@
  * always follow the same interface.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
 #include <vector>
 
+/**
+ * Every heap allocation made by this program is counted, so that the examples
+ * below can show how many allocations a build costs. The counter is per
+ * thread, so counting doesn't get in the way of building in parallel.
+ */
+static thread_local size_t g_allocations = 0;
+
+// The replacements are kept out of line: once inlined, the compiler sees
+// malloc() and free() paired with new and delete and warns about a mismatch.
+__attribute__((noinline)) void* operator new(size_t size) {
+  ++g_allocations;
+  if (void* memory = std::malloc(size ? size : 1)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+__attribute__((noinline)) void operator delete(void* memory,
+                                                size_t) noexcept {
+  std::free(memory);
+}
+
+/**
+ * Products can be serialized either as human readable text, the parts that
+ * ListParts() prints separated by ", " on one line but without its
+ * "Product parts: " prefix and trailing blank line, or in a compact binary
+ * form: a 32-bit part count followed by every part as a 32-bit length and its
+ * bytes, all little-endian.
+ */
+enum class Encoding { kText, kBinary };
+
 class Product1 {
  public:
   std::vector<std::string> parts_;
   void ListParts() const {
     std::cout << "Product parts: ";
     for (size_t i = 0; i < parts_.size(); i++) {
-      if (parts_[i] == parts_.back()) {
+      if (i + 1 == parts_.size()) {
         std::cout << parts_[i];
       } else {
         std::cout << parts_[i] << ", ";
@@ -24,8 +65,87 @@ class Product1 {
     }
     std::cout << "\n\n";
   }
+
+  /**
+   * Appends the product to `sink` in a single pass over its parts. A sink is
+   * anything with an `append(const char*, size_t)` method, such as a
+   * std::string used as a buffer, so the product can be shipped without going
+   * through iostreams.
+   */
+  template <typename Sink>
+  void Serialize(Sink& sink, Encoding encoding) const {
+    if (encoding == Encoding::kText) {
+      for (size_t i = 0; i < parts_.size(); i++) {
+        if (i > 0) {
+          sink.append(", ", 2);
+        }
+        sink.append(parts_[i].data(), parts_[i].size());
+      }
+      sink.append("\n", 1);
+    } else {
+      AppendUint32(sink, static_cast<uint32_t>(parts_.size()));
+      for (const std::string& part : parts_) {
+        AppendUint32(sink, static_cast<uint32_t>(part.size()));
+        sink.append(part.data(), part.size());
+      }
+    }
+  }
+
+  /**
+   * Reads back one product in the binary encoding from [data, end) and moves
+   * `data` past it. Returns false if the input is truncated.
+   */
+  bool ParseBinary(const char*& data, const char* end) {
+    uint32_t count;
+    if (!ReadUint32(data, end, count)) {
+      return false;
+    }
+    parts_.clear();
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t size;
+      if (!ReadUint32(data, end, size) ||
+          static_cast<size_t>(end - data) < size) {
+        return false;
+      }
+      parts_.emplace_back(data, size);
+      data += size;
+    }
+    return true;
+  }
+
+ private:
+  static bool ReadUint32(const char*& data, const char* end, uint32_t& value) {
+    if (end - data < 4) {
+      return false;
+    }
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+            static_cast<uint32_t>(bytes[3]) << 24;
+    data += 4;
+    return true;
+  }
+
+  template <typename Sink>
+  static void AppendUint32(Sink& sink, uint32_t value) {
+    const char bytes[4] = {
+        static_cast<char>(value & 0xff), static_cast<char>(value >> 8 & 0xff),
+        static_cast<char>(value >> 16 & 0xff),
+        static_cast<char>(value >> 24 & 0xff)};
+    sink.append(bytes, sizeof(bytes));
+  }
 };
 
+/**
+ * Serializes a whole batch of products, one after another, into the same sink.
+ */
+template <typename Sink>
+void SerializeProducts(const std::vector<std::unique_ptr<Product1>>& products,
+                       Sink& sink, Encoding encoding) {
+  for (const std::unique_ptr<Product1>& product : products) {
+    product->Serialize(sink, encoding);
+  }
+}
+
 /**
  * The Builder interface specifies methods for creating the different parts of
  * the Product objects.
@@ -97,6 +217,115 @@ class ConcreteBuilder1 : public Builder {
   }
 };
 
+/**
+ * ConcreteBuilder1 allocates a new product after every build and a new string
+ * for every part. When the same kinds of products are built over and over,
+ * both can be recycled.
+ *
+ * The PartTable interns part names, so a product only stores small ids.
+ */
+class PartTable {
+ public:
+  using Id = uint16_t;
+
+ private:
+  std::vector<std::string> names_;
+
+ public:
+  Id Intern(const std::string& name) {
+    for (size_t i = 0; i < names_.size(); i++) {
+      if (names_[i] == name) {
+        return static_cast<Id>(i);
+      }
+    }
+    names_.push_back(name);
+    return static_cast<Id>(names_.size() - 1);
+  }
+  const std::string& Name(Id id) const { return names_[id]; }
+};
+
+class RecycledProduct1 {
+ public:
+  const PartTable* part_table_;
+  std::vector<PartTable::Id> parts_;
+
+  explicit RecycledProduct1(const PartTable* part_table)
+      : part_table_(part_table) {}
+  void ListParts() const {
+    std::cout << "Product parts: ";
+    for (size_t i = 0; i < parts_.size(); i++) {
+      if (i > 0) {
+        std::cout << ", ";
+      }
+      std::cout << part_table_->Name(parts_[i]);
+    }
+    std::cout << "\n\n";
+  }
+};
+
+/**
+ * The RecyclingBuilder1 keeps every product it has ever made. GetProduct()
+ * hands one out through a handle that gives it back to the builder instead of
+ * deleting it. Reset() takes a returned product and only clears its parts, so
+ * the capacity it grew in earlier builds is kept. Once the loop has warmed up,
+ * building a product doesn't touch the heap at all.
+ *
+ * The handles must not outlive the builder.
+ */
+class RecyclingBuilder1 : public Builder {
+ private:
+  struct Recycler {
+    RecyclingBuilder1* builder_;
+    void operator()(RecycledProduct1* product) const {
+      builder_->free_.push_back(product);
+    }
+  };
+
+ public:
+  using ProductHandle = std::unique_ptr<RecycledProduct1, Recycler>;
+
+ private:
+  PartTable part_table_;
+  PartTable::Id part_a_;
+  PartTable::Id part_b_;
+  PartTable::Id part_c_;
+  std::vector<std::unique_ptr<RecycledProduct1>> storage_;
+  std::vector<RecycledProduct1*> free_;
+  RecycledProduct1* product_;
+
+ public:
+  RecyclingBuilder1()
+      : part_a_(part_table_.Intern("PartA1")),
+        part_b_(part_table_.Intern("PartB1")),
+        part_c_(part_table_.Intern("PartC1")) {
+    Reset();
+  }
+
+  void Reset() {
+    if (free_.empty()) {
+      storage_.emplace_back(new RecycledProduct1(&part_table_));
+      free_.reserve(storage_.size());
+      product_ = storage_.back().get();
+    } else {
+      product_ = free_.back();
+      free_.pop_back();
+    }
+    product_->parts_.clear();
+  }
+
+  void ProducePartA() const override { product_->parts_.push_back(part_a_); }
+
+  void ProducePartB() const override { product_->parts_.push_back(part_b_); }
+
+  void ProducePartC() const override { product_->parts_.push_back(part_c_); }
+
+  ProductHandle GetProduct() {
+    ProductHandle result(product_, Recycler{this});
+    Reset();
+    return result;
+  }
+};
+
 /**
  * The Director is only responsible for executing the building steps in a
  * particular sequence. It is helpful when producing products according to a
@@ -131,6 +360,60 @@ class Director {
     builder_->ProducePartC();
   }
 };
+/**
+ * A recipe names one of the Director's product variations.
+ */
+enum class Recipe { kMinimalViableProduct, kFullFeaturedProduct };
+
+/**
+ * The ParallelDirector builds a whole list of recipes on several threads. Every
+ * worker gets its own builder and Director and takes a contiguous slice of the
+ * recipes. Each finished product goes into the slot of its recipe, so workers
+ * never write to the same place and no lock is needed.
+ */
+class ParallelDirector {
+ public:
+  std::vector<std::unique_ptr<Product1>> Build(
+      const std::vector<Recipe>& recipes, size_t thread_count) const {
+    std::vector<std::unique_ptr<Product1>> products(recipes.size());
+    thread_count = std::max<size_t>(1, std::min(thread_count, recipes.size()));
+    size_t slice = (recipes.size() + thread_count - 1) / thread_count;
+
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < thread_count; t++) {
+      workers.emplace_back(&ParallelDirector::BuildSlice, &recipes,
+                           &products, t * slice,
+                           std::min((t + 1) * slice, recipes.size()));
+    }
+    // The calling thread takes the first slice itself.
+    BuildSlice(&recipes, &products, 0, std::min(slice, recipes.size()));
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    return products;
+  }
+
+ private:
+  static void BuildSlice(const std::vector<Recipe>* recipes,
+                         std::vector<std::unique_ptr<Product1>>* products,
+                         size_t begin, size_t end) {
+    ConcreteBuilder1 builder;
+    Director director;
+    director.set_builder(&builder);
+    for (size_t i = begin; i < end; i++) {
+      switch ((*recipes)[i]) {
+        case Recipe::kMinimalViableProduct:
+          director.BuildMinimalViableProduct();
+          break;
+        case Recipe::kFullFeaturedProduct:
+          director.BuildFullFeaturedProduct();
+          break;
+      }
+      (*products)[i].reset(builder.GetProduct());
+    }
+  }
+};
+
 /**
  * The client code creates a builder object, passes it to the director and then
  * initiates the construction process. The end result is retrieved from the
@@ -168,9 +451,131 @@ void ClientCode(Director& director) {
   delete builder;
 }
 
+/**
+ * Runs the same build loop with both builders and counts the heap allocations
+ * made in the steady state, after warming up.
+ */
+bool CheckSteadyStateAllocations(Director& director) {
+  const int kBuilds = 1000;
+  size_t checksum = 0;
+
+  ConcreteBuilder1 builder;
+  director.set_builder(&builder);
+  size_t before = g_allocations;
+  for (int i = 0; i < kBuilds; i++) {
+    director.BuildFullFeaturedProduct();
+    Product1* p = builder.GetProduct();
+    checksum += p->parts_.size();
+    delete p;
+  }
+  size_t plain_allocations = g_allocations - before;
+
+  RecyclingBuilder1 recycling_builder;
+  director.set_builder(&recycling_builder);
+  // The builder alternates between two products here: one being built while
+  // the other one is handed out. Warm both of them up.
+  for (int i = 0; i < 2; i++) {
+    director.BuildFullFeaturedProduct();
+    recycling_builder.GetProduct();
+  }
+  before = g_allocations;
+  for (int i = 0; i < kBuilds; i++) {
+    director.BuildFullFeaturedProduct();
+    RecyclingBuilder1::ProductHandle p = recycling_builder.GetProduct();
+    checksum += p->parts_.size();
+  }
+  size_t recycled_allocations = g_allocations - before;
+
+  std::cout << "ConcreteBuilder1:  " << plain_allocations << " allocations in "
+            << kBuilds << " builds\n";
+  std::cout << "RecyclingBuilder1: " << recycled_allocations
+            << " allocations in " << kBuilds << " builds\n";
+  std::cout << "(checksum " << checksum << ")\n";
+  return recycled_allocations == 0;
+}
+
+/**
+ * Decodes a buffer of binary-serialized products and checks that it gives back
+ * exactly the original parts.
+ */
+bool CheckBinaryRoundTrip(
+    const std::vector<std::unique_ptr<Product1>>& products,
+    const std::string& buffer) {
+  const char* data = buffer.data();
+  const char* end = data + buffer.size();
+  for (const std::unique_ptr<Product1>& product : products) {
+    Product1 decoded;
+    if (!decoded.ParseBinary(data, end) || decoded.parts_ != product->parts_) {
+      return false;
+    }
+  }
+  return data == end;
+}
+
+/**
+ * Builds the same batch of recipes with an increasing number of threads.
+ */
+void BenchmarkParallelDirector() {
+  const size_t kRecipes = 400000;
+  std::vector<Recipe> recipes(kRecipes);
+  for (size_t i = 0; i < kRecipes; i++) {
+    recipes[i] = i % 4 == 0 ? Recipe::kMinimalViableProduct
+                            : Recipe::kFullFeaturedProduct;
+  }
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  ParallelDirector director;
+  double single_thread_rate = 0;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<Product1>> products =
+        director.Build(recipes, threads);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    products.clear();
+    double rate = kRecipes / elapsed.count();
+    if (threads == 1) {
+      single_thread_rate = rate;
+    }
+    std::cout << threads << " thread(s): " << rate << " products/s, speedup "
+              << rate / single_thread_rate << "x\n";
+  }
+}
+
 int main() {
   Director* director = new Director();
   ClientCode(*director);
+
+  std::cout << "Recycled full featured product:\n";
+  RecyclingBuilder1 recycling_builder;
+  director->set_builder(&recycling_builder);
+  director->BuildFullFeaturedProduct();
+  recycling_builder.GetProduct()->ListParts();
+
+  std::cout << "Heap allocations in a steady-state build loop:\n";
+  bool allocation_free = CheckSteadyStateAllocations(*director);
   delete director;
-  return 0;
+  std::cout << "\n";
+
+  std::cout << "Products built in parallel from a list of recipes:\n";
+  std::vector<std::unique_ptr<Product1>> products = ParallelDirector().Build(
+      {Recipe::kMinimalViableProduct, Recipe::kFullFeaturedProduct}, 2);
+  for (const std::unique_ptr<Product1>& product : products) {
+    product->ListParts();
+  }
+
+  std::cout << "The same products serialized into one buffer:\n";
+  std::string buffer;
+  SerializeProducts(products, buffer, Encoding::kText);
+  std::cout << buffer;
+  buffer.clear();
+  SerializeProducts(products, buffer, Encoding::kBinary);
+  bool round_trip = CheckBinaryRoundTrip(products, buffer);
+  std::cout << "(" << buffer.size() << " bytes in binary, "
+            << (round_trip ? "decoded back unchanged" : "DECODING FAILED")
+            << ")\n\n";
+
+  std::cout << "Benchmark: building products on 1 to N threads:\n";
+  BenchmarkParallelDirector();
+  return allocation_free && round_trip ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
@@ -3,13 +3,34 @@
  * implement.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 class Product {
  public:
   virtual ~Product() {}
   virtual std::string Operation() const = 0;
+  /**
+   * Appends the result of Operation() to `out` instead of returning a new
+   * string. A caller that reuses the same buffer keeps its capacity, so
+   * formatting results doesn't allocate. Products that don't override this
+   * still work, at the price of a temporary.
+   */
+  virtual void AppendOperation(std::string& out) const { out += Operation(); }
 };
 
 /**
@@ -20,12 +41,126 @@ class ConcreteProduct1 : public Product {
   std::string Operation() const override {
     return "{Result of the ConcreteProduct1}";
   }
+  void AppendOperation(std::string& out) const override {
+    out += "{Result of the ConcreteProduct1}";
+  }
 };
 class ConcreteProduct2 : public Product {
  public:
   std::string Operation() const override {
     return "{Result of the ConcreteProduct2}";
   }
+  void AppendOperation(std::string& out) const override {
+    out += "{Result of the ConcreteProduct2}";
+  }
+};
+
+/**
+ * Pooled products are handed out as owning handles. Instead of deleting the
+ * product, the handle passes it to the function that knows where the product
+ * came from.
+ */
+struct ProductRecycler {
+  void (*recycle_)(Product*);
+  void operator()(Product* product) const { recycle_(product); }
+};
+
+using PooledProduct = std::unique_ptr<Product, ProductRecycler>;
+
+struct PoolStats {
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+/**
+ * The ProductPool keeps a free list of ConcreteProducts for every thread, so
+ * borrowing and returning a product never needs a lock. A product goes back to
+ * the free list of the thread that releases it; once that list holds
+ * `capacity()` products, any further ones are deleted.
+ *
+ * Handles must be released before their thread exits. When a thread exits,
+ * its hits and misses are added to a total shared by all threads.
+ */
+template <typename ConcreteProduct>
+class ProductPool {
+ private:
+  struct FreeList {
+    std::vector<ConcreteProduct*> products_;
+    PoolStats stats_;
+    ~FreeList() {
+      for (ConcreteProduct* product : products_) {
+        delete product;
+      }
+      std::lock_guard<std::mutex> lock(ExitedMutex());
+      ExitedStats().hits += stats_.hits;
+      ExitedStats().misses += stats_.misses;
+    }
+  };
+
+  static std::mutex& ExitedMutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+  static PoolStats& ExitedStats() {
+    static PoolStats stats;
+    return stats;
+  }
+
+  static FreeList& Local() {
+    thread_local FreeList free_list;
+    return free_list;
+  }
+
+  static void Recycle(Product* product) {
+    FreeList& free_list = Local();
+    if (free_list.products_.size() < capacity()) {
+      free_list.products_.push_back(static_cast<ConcreteProduct*>(product));
+    } else {
+      delete product;
+    }
+  }
+
+  static size_t& Capacity() {
+    static size_t capacity = 64;
+    return capacity;
+  }
+
+ public:
+  /**
+   * The capacity of every thread's free list. Set it before the pool is used.
+   */
+  static size_t capacity() { return Capacity(); }
+  static void set_capacity(size_t capacity) { Capacity() = capacity; }
+
+  static PooledProduct Acquire() {
+    FreeList& free_list = Local();
+    ConcreteProduct* product;
+    if (free_list.products_.empty()) {
+      ++free_list.stats_.misses;
+      product = new ConcreteProduct();
+    } else {
+      ++free_list.stats_.hits;
+      product = free_list.products_.back();
+      free_list.products_.pop_back();
+    }
+    return PooledProduct(product, ProductRecycler{&Recycle});
+  }
+
+  /**
+   * Hits and misses of the calling thread's free list.
+   */
+  static PoolStats stats() { return Local().stats_; }
+
+  /**
+   * Hits and misses of all threads that have exited, plus the calling one.
+   */
+  static PoolStats total_stats() {
+    PoolStats total = stats();
+    std::lock_guard<std::mutex> lock(ExitedMutex());
+    total.hits += ExitedStats().hits;
+    total.misses += ExitedStats().misses;
+    return total;
+  }
 };
 
 /**
@@ -60,6 +195,34 @@ class Creator {
     delete product;
     return result;
   }
+
+  /**
+   * Creators can borrow their products from a pool instead. By default the
+   * pooled factory method just wraps FactoryMethod(), and the product is
+   * deleted when the handle goes away.
+   */
+  virtual PooledProduct PooledFactoryMethod() const {
+    return PooledProduct(FactoryMethod(), ProductRecycler{&DeleteProduct});
+  }
+
+  std::string SomePooledOperation() const {
+    PooledProduct product = PooledFactoryMethod();
+    return "Creator: The same creator's code has just worked with " +
+           product->Operation();
+  }
+
+  /**
+   * Appends the result of SomeOperation() to `out`. Together with a pooled
+   * product, a warmed-up call doesn't allocate at all.
+   */
+  void AppendSomeOperation(std::string& out) const {
+    PooledProduct product = PooledFactoryMethod();
+    out += "Creator: The same creator's code has just worked with ";
+    product->AppendOperation(out);
+  }
+
+ private:
+  static void DeleteProduct(Product* product) { delete product; }
 };
 
 /**
@@ -74,13 +237,193 @@ class ConcreteCreator1 : public Creator {
    */
  public:
   Product* FactoryMethod() const override { return new ConcreteProduct1(); }
+  PooledProduct PooledFactoryMethod() const override {
+    return ProductPool<ConcreteProduct1>::Acquire();
+  }
 };
 
 class ConcreteCreator2 : public Creator {
  public:
   Product* FactoryMethod() const override { return new ConcreteProduct2(); }
+  PooledProduct PooledFactoryMethod() const override {
+    return ProductPool<ConcreteProduct2>::Acquire();
+  }
+};
+
+/**
+ * When the product type comes from configuration or request metadata, the
+ * creator has to be found by name. The CreatorRegistry owns one creator per
+ * product name and resolves names through a minimal perfect hash, built once
+ * at startup by Build(): every name maps to its own slot, so a lookup hashes
+ * the name once, compares it with a single candidate and never allocates.
+ *
+ * The hash is built with "hash and displace": names are first spread over
+ * buckets, then, starting with the largest bucket, each bucket gets the first
+ * seed that sends all its names to free slots.
+ */
+class CreatorRegistry {
+ private:
+  struct Entry {
+    std::string name_;
+    std::unique_ptr<Creator> creator_;
+  };
+
+  std::vector<Entry> entries_;
+  std::unordered_set<std::string> names_;
+  std::vector<uint32_t> seeds_;
+  bool built_ = false;
+
+  static uint64_t Mix(uint64_t value) {
+    value ^= value >> 32;
+    value *= 0xd6e8feb86659fd93ull;
+    value ^= value >> 32;
+    return value;
+  }
+
+  /**
+   * Names are hashed a word at a time, and only once per lookup: the bucket
+   * and the slot are both derived from the same hash.
+   */
+  static uint64_t Hash(std::string_view name) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ name.size();
+    size_t i = 0;
+    for (; i + 8 <= name.size(); i += 8) {
+      uint64_t word;
+      std::memcpy(&word, name.data() + i, 8);
+      hash = Mix(hash ^ word);
+    }
+    uint64_t tail = 0;
+    if (i < name.size()) {
+      if (name.size() >= 8) {
+        // Reread the last eight bytes instead of copying a variable-length
+        // tail; the length in the seed keeps the overlap unambiguous.
+        std::memcpy(&tail, name.data() + name.size() - 8, 8);
+      } else {
+        std::memcpy(&tail, name.data(), name.size());
+      }
+    }
+    return Mix(hash ^ tail);
+  }
+
+  /**
+   * Maps a hash onto [0, size) without a division.
+   */
+  static uint32_t Reduce(uint64_t hash, size_t size) {
+    return static_cast<uint32_t>(((hash >> 32) * size) >> 32);
+  }
+
+  static uint32_t Slot(uint64_t hash, uint32_t seed, size_t size) {
+    return Reduce(Mix(hash ^ (seed * 0x9e3779b97f4a7c15ull)), size);
+  }
+
+ public:
+  /**
+   * The registry that self-registering creators add themselves to.
+   */
+  static CreatorRegistry& Global() {
+    static CreatorRegistry registry;
+    return registry;
+  }
+
+  /**
+   * Throws if `name` is already registered: equal names always hash to the
+   * same slot, so Build() could never separate them. Build() has to be called
+   * again after registering.
+   */
+  void Register(std::string_view name, std::unique_ptr<Creator> creator) {
+    if (!names_.emplace(name).second) {
+      throw std::logic_error("CreatorRegistry: duplicate creator " +
+                             std::string(name));
+    }
+    entries_.push_back(Entry{std::string(name), std::move(creator)});
+    built_ = false;
+  }
+
+  void Build() {
+    const size_t count = entries_.size();
+    seeds_.assign(std::max<size_t>(1, count / 2), 0);
+    std::vector<uint32_t> slots(count, UINT32_MAX);
+
+    std::vector<std::vector<uint32_t>> buckets(seeds_.size());
+    for (uint32_t i = 0; i < count; i++) {
+      buckets[Reduce(Hash(entries_[i].name_), buckets.size())].push_back(i);
+    }
+    std::vector<uint32_t> order(buckets.size());
+    for (uint32_t b = 0; b < order.size(); b++) {
+      order[b] = b;
+    }
+    std::sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<uint32_t> taken;
+    for (uint32_t b : order) {
+      if (buckets[b].empty()) {
+        break;
+      }
+      for (uint32_t seed = 1;; seed++) {
+        if (seed == UINT32_MAX) {
+          throw std::runtime_error("CreatorRegistry: no perfect hash found");
+        }
+        taken.clear();
+        for (uint32_t entry : buckets[b]) {
+          uint32_t slot = Slot(Hash(entries_[entry].name_), seed, count);
+          if (slots[slot] != UINT32_MAX ||
+              std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+            break;
+          }
+          taken.push_back(slot);
+        }
+        if (taken.size() == buckets[b].size()) {
+          seeds_[b] = seed;
+          for (size_t i = 0; i < taken.size(); i++) {
+            slots[taken[i]] = buckets[b][i];
+          }
+          break;
+        }
+      }
+    }
+    // Store the entries in slot order, so that a lookup goes from the slot
+    // straight to its entry.
+    std::vector<Entry> ordered(count);
+    for (uint32_t slot = 0; slot < count; slot++) {
+      ordered[slot] = std::move(entries_[slots[slot]]);
+    }
+    entries_ = std::move(ordered);
+    built_ = true;
+  }
+
+  /**
+   * Returns the creator registered under `name`, or nullptr.
+   */
+  const Creator* Find(std::string_view name) const {
+    if (!built_ || entries_.empty()) {
+      return nullptr;
+    }
+    uint64_t hash = Hash(name);
+    uint32_t seed = seeds_[Reduce(hash, seeds_.size())];
+    const Entry& entry = entries_[Slot(hash, seed, entries_.size())];
+    return entry.name_ == name ? entry.creator_.get() : nullptr;
+  }
+};
+
+/**
+ * Creators register themselves by defining a static CreatorRegistration.
+ */
+template <typename ConcreteCreator>
+class CreatorRegistration {
+ public:
+  explicit CreatorRegistration(std::string_view name) {
+    CreatorRegistry::Global().Register(name,
+                                       std::make_unique<ConcreteCreator>());
+  }
 };
 
+static CreatorRegistration<ConcreteCreator1> g_creator1_registration(
+    "ConcreteProduct1");
+static CreatorRegistration<ConcreteCreator2> g_creator2_registration(
+    "ConcreteProduct2");
+
 /**
  * The client code works with an instance of a concrete creator, albeit through
  * its base interface. As long as the client keeps working with the creator via
@@ -94,12 +437,158 @@ void ClientCode(const Creator& creator) {
   // ...
 }
 
+/**
+ * Runs `operations` calls of the given operation on each of `threads` threads
+ * and returns the total number of operations per second. The length of all
+ * results is added to `length`.
+ */
+double MeasureOperations(const Creator& creator, bool pooled, int threads,
+                         int operations, size_t& length) {
+  std::vector<size_t> lengths(threads, 0);
+  auto worker = [&creator, pooled, operations](size_t& thread_length) {
+    size_t local_length = 0;
+    for (int i = 0; i < operations; i++) {
+      local_length += pooled ? creator.SomePooledOperation().size()
+                             : creator.SomeOperation().size();
+    }
+    thread_length = local_length;
+  };
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back(worker, std::ref(lengths[t]));
+  }
+  for (std::thread& w : workers) {
+    w.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  for (size_t thread_length : lengths) {
+    length += thread_length;
+  }
+  return threads * operations / elapsed.count();
+}
+
+/**
+ * `creator` must borrow its products from ProductPool<ConcreteProduct>, whose
+ * hits and misses are reported for the pooled runs.
+ */
+template <typename ConcreteProduct>
+void BenchmarkPool(const Creator& creator) {
+  const int kOperations = 200000;
+  size_t length = 0;
+  for (int threads : {1, 4, 16}) {
+    double plain_rate =
+        MeasureOperations(creator, false, threads, kOperations, length);
+    PoolStats before = ProductPool<ConcreteProduct>::total_stats();
+    double pooled_rate =
+        MeasureOperations(creator, true, threads, kOperations, length);
+    PoolStats after = ProductPool<ConcreteProduct>::total_stats();
+    std::cout << threads << " thread(s): " << plain_rate
+              << " ops/s with new/delete, " << pooled_rate
+              << " ops/s pooled (hits " << after.hits - before.hits
+              << ", misses " << after.misses - before.misses << ")\n";
+  }
+  std::cout << "(" << length << " bytes formatted)\n";
+}
+
+/**
+ * Measures how long it takes to build the perfect hash for a large number of
+ * names, and how fast names are resolved afterwards compared to an
+ * std::unordered_map keyed by std::string.
+ */
+void BenchmarkRegistry() {
+  const size_t kNames = 10000;
+  const size_t kLookups = 10000000;
+  std::vector<std::string> names;
+  for (size_t i = 0; i < kNames; i++) {
+    names.push_back("product_with_a_long_name_" + std::to_string(i));
+  }
+
+  CreatorRegistry registry;
+  std::unordered_map<std::string, const Creator*> map;
+  for (const std::string& name : names) {
+    registry.Register(name, std::make_unique<ConcreteCreator1>());
+  }
+  auto start = std::chrono::steady_clock::now();
+  registry.Build();
+  std::chrono::duration<double> build_time =
+      std::chrono::steady_clock::now() - start;
+  for (const std::string& name : names) {
+    map[name] = registry.Find(name);
+  }
+
+  // The map gets its own std::string queries, built up front, so that its
+  // lookups don't pay for a heap-allocated key each.
+  std::vector<std::string_view> queries;
+  std::vector<std::string> map_queries;
+  for (size_t i = 0; i < kNames; i++) {
+    queries.push_back(names[(i * 7919) % kNames]);
+    map_queries.push_back(names[(i * 7919) % kNames]);
+  }
+
+  size_t found = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kLookups; i++) {
+    found += registry.Find(queries[i % kNames]) != nullptr;
+  }
+  std::chrono::duration<double> registry_time =
+      std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < kLookups; i++) {
+    found += map.find(map_queries[i % kNames]) != map.end();
+  }
+  std::chrono::duration<double> map_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "cold start: " << kNames << " names hashed in "
+            << build_time.count() * 1e3 << " ms\n";
+  std::cout << "perfect hash:  " << kLookups / registry_time.count()
+            << " lookups/s\n";
+  std::cout << "unordered_map: " << kLookups / map_time.count()
+            << " lookups/s\n";
+  std::cout << "(found " << found << ")\n";
+}
+
+/**
+ * Compares the string-returning operation with appending into one reused
+ * buffer. Both sides borrow their product through PooledFactoryMethod(), so
+ * only the way the text is returned differs.
+ */
+void BenchmarkFormatting(const Creator& creator) {
+  const int kOperations = 5000000;
+  size_t length = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kOperations; i++) {
+    length += creator.SomePooledOperation().size();
+  }
+  std::chrono::duration<double> string_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::string buffer;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kOperations; i++) {
+    buffer.clear();
+    creator.AppendSomeOperation(buffer);
+    length += buffer.size();
+  }
+  std::chrono::duration<double> append_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "returning strings:   " << kOperations / string_time.count()
+            << " ops/s\n";
+  std::cout << "appending to buffer: " << kOperations / append_time.count()
+            << " ops/s\n";
+  std::cout << "(" << length << " bytes formatted)\n";
+}
+
 /**
  * The Application picks a creator's type depending on the configuration or
  * environment.
  */
 
-int main() {
+int main(int argc, char* argv[]) {
   std::cout << "App: Launched with the ConcreteCreator1.\n";
   Creator* creator = new ConcreteCreator1();
   ClientCode(*creator);
@@ -108,6 +597,49 @@ int main() {
   Creator* creator2 = new ConcreteCreator2();
   ClientCode(*creator2);
 
+  std::cout << std::endl;
+
+  std::cout
+      << "App: Launched with the ConcreteCreator1 borrowing from a pool.\n";
+  ProductPool<ConcreteProduct1>::set_capacity(16);
+  for (int i = 0; i < 3; i++) {
+    std::cout << creator->SomePooledOperation() << "\n";
+  }
+  PoolStats stats = ProductPool<ConcreteProduct1>::stats();
+  std::cout << "Pool hits: " << stats.hits << ", misses: " << stats.misses
+            << "\n\n";
+
+  std::cout
+      << "Benchmark: SomeOperation with new/delete vs. pooled products:\n";
+  BenchmarkPool<ConcreteProduct1>(*creator);
+  std::cout << std::endl;
+
+  CreatorRegistry::Global().Build();
+  std::string_view configured = argc > 1 ? argv[1] : "ConcreteProduct2";
+  std::cout << "App: Launched with the creator configured as \"" << configured
+            << "\".\n";
+  if (const Creator* registered = CreatorRegistry::Global().Find(configured)) {
+    ClientCode(*registered);
+  } else {
+    std::cout << "App: No creator is registered under that name.\n";
+  }
+  std::cout << std::endl;
+
+  std::cout << "Benchmark: building and querying the creator registry:\n";
+  BenchmarkRegistry();
+  std::cout << std::endl;
+
+  std::cout
+      << "App: Formatting the results of both creators into one buffer.\n";
+  std::string buffer;
+  creator->AppendSomeOperation(buffer);
+  buffer += "\n";
+  creator2->AppendSomeOperation(buffer);
+  std::cout << buffer << "\n\n";
+
+  std::cout << "Benchmark: returning strings vs. appending to a buffer:\n";
+  BenchmarkFormatting(*creator);
+
   delete creator;
   delete creator2;
   return 0;
@@ -1,34 +1,263 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 // Prototype Design Pattern
 //
 // Intent: Lets you copy existing objects without making your code dependent on
 // their classes.
 
-enum Type { PROTOTYPE_1 = 0, PROTOTYPE_2 };
+/**
+ * The heap bytes requested by this program are counted, so that the examples
+ * below can show how much memory the clones take. The counter is atomic
+ * because the factory may be cloned from on several threads.
+ */
+static std::atomic<size_t> g_allocated_bytes{0};
+
+// noinline keeps GCC's -Wmismatched-new-delete quiet, which otherwise fires
+// when it inlines these functions and ends up seeing the malloc() and free().
+__attribute__((noinline)) void *operator new(size_t size) {
+  g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void *memory = std::malloc(size ? size : 1)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *memory) noexcept {
+  std::free(memory);
+}
+__attribute__((noinline)) void operator delete(void *memory,
+                                                size_t) noexcept {
+  std::free(memory);
+}
+
+/**
+ * Type has a fixed underlying type, so that further type values can be
+ * registered at runtime.
+ */
+enum Type : int { PROTOTYPE_1 = 0, PROTOTYPE_2 };
+
+class Prototype;
+
+/**
+ * Prototypes can be saved into a snapshot file and loaded back from it. The
+ * file is written in native byte order:
+ *
+ *   header:  "PROTOSNP", uint32 version, uint32 slot count
+ *   slots:   one {uint32 kind, uint32 size, uint64 offset} per Type value; a
+ *            kind of kNoPrototype means nothing is registered for that type
+ *   records: the fields of every prototype, as written by its Save() method
+ */
+const char kSnapshotMagic[8] = {'P', 'R', 'O', 'T', 'O', 'S', 'N', 'P'};
+const uint32_t kSnapshotVersion = 1;
+const size_t kSnapshotHeaderSize = 16;
+const size_t kSnapshotSlotSize = 16;
+
+enum SnapshotKind : uint32_t {
+  kNoPrototype = 0,
+  kConcretePrototype1,
+  kConcretePrototype2,
+  kCowPrototype
+};
+
+class SnapshotWriter {
+ private:
+  std::string &out_;
+
+ public:
+  explicit SnapshotWriter(std::string &out) : out_(out) {}
+  void WriteBytes(const void *data, size_t size) {
+    out_.append(static_cast<const char *>(data), size);
+  }
+  void WriteUint32(uint32_t value) { WriteBytes(&value, sizeof(value)); }
+  void WriteUint64(uint64_t value) { WriteBytes(&value, sizeof(value)); }
+  void WriteFloat(float value) { WriteBytes(&value, sizeof(value)); }
+  void WriteString(const std::string &value) {
+    WriteUint32(static_cast<uint32_t>(value.size()));
+    WriteBytes(value.data(), value.size());
+  }
+};
+
+class SnapshotReader {
+ private:
+  const char *data_;
+  const char *end_;
+
+ public:
+  SnapshotReader(const char *data, size_t size)
+      : data_(data), end_(data + size) {}
+  void ReadBytes(void *out, size_t size) {
+    if (static_cast<size_t>(end_ - data_) < size) {
+      throw std::runtime_error("Prototype snapshot is truncated");
+    }
+    std::memcpy(out, data_, size);
+    data_ += size;
+  }
+  uint32_t ReadUint32() {
+    uint32_t value;
+    ReadBytes(&value, sizeof(value));
+    return value;
+  }
+  uint64_t ReadUint64() {
+    uint64_t value;
+    ReadBytes(&value, sizeof(value));
+    return value;
+  }
+  float ReadFloat() {
+    float value;
+    ReadBytes(&value, sizeof(value));
+    return value;
+  }
+  std::string ReadString() {
+    uint32_t size = ReadUint32();
+    if (static_cast<size_t>(end_ - data_) < size) {
+      throw std::runtime_error("Prototype snapshot is truncated");
+    }
+    std::string value(data_, size);
+    data_ += size;
+    return value;
+  }
+};
+
+/**
+ * A PrototypeSlab is caller-owned storage for many clones of one prototype,
+ * laid out next to each other. Filling it again reuses its memory when it is
+ * large enough, and all clones are destroyed together by Clear() or by the
+ * slab's destructor. The clones are still used through the Prototype
+ * interface.
+ */
+class PrototypeSlab {
+ private:
+  unsigned char *data_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  size_t stride_ = 0;
+  Prototype *(*as_prototype_)(unsigned char *) = nullptr;
+  void (*destroy_)(unsigned char *) = nullptr;
+
+ public:
+  PrototypeSlab() {}
+  PrototypeSlab(const PrototypeSlab &) = delete;
+  PrototypeSlab &operator=(const PrototypeSlab &) = delete;
+  ~PrototypeSlab() {
+    Clear();
+    ::operator delete(data_);
+  }
+
+  size_t size() const { return size_; }
+  Prototype *operator[](size_t index) const {
+    return as_prototype_(data_ + index * stride_);
+  }
+
+  void Clear() {
+    for (size_t i = size_; i > 0; i--) {
+      destroy_(data_ + (i - 1) * stride_);
+    }
+    size_ = 0;
+  }
+
+  /**
+   * Replaces the slab's content with `count` copies of `original`. Concrete
+   * prototypes call this from their CloneN(). `original` may itself live in
+   * the slab, as in `slab[0]->CloneN(n, slab)`, so it is copied before the old
+   * content is destroyed.
+   */
+  template <typename ConcretePrototype>
+  void Fill(const ConcretePrototype &original, size_t count) {
+    static_assert(alignof(ConcretePrototype) <=
+                      __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                  "over-aligned prototypes are not supported");
+    const ConcretePrototype source(original);
+    Clear();
+    size_t bytes = count * sizeof(ConcretePrototype);
+    if (bytes > capacity_) {
+      ::operator delete(data_);
+      data_ = nullptr;
+      capacity_ = 0;
+      data_ = static_cast<unsigned char *>(::operator new(bytes));
+      capacity_ = bytes;
+    }
+    stride_ = sizeof(ConcretePrototype);
+    as_prototype_ = [](unsigned char *object) -> Prototype * {
+      return reinterpret_cast<ConcretePrototype *>(object);
+    };
+    destroy_ = [](unsigned char *object) {
+      reinterpret_cast<ConcretePrototype *>(object)->~ConcretePrototype();
+    };
+    for (; size_ < count; size_++) {
+      new (data_ + size_ * stride_) ConcretePrototype(source);
+    }
+  }
+};
 
 /**
  * The example class that has cloning ability. We'll see how the values of field
  * with different types will be cloned.
+ *
+ * The interface itself holds no fields, so that each kind of prototype can
+ * decide how its fields are stored and copied.
  */
 
 class Prototype {
+ public:
+  virtual ~Prototype() {}
+  virtual Prototype *Clone() const = 0;
+  /**
+   * Places `count` copies next to each other in `slab`, replacing whatever the
+   * slab held before. One virtual call covers all the copies.
+   */
+  virtual void CloneN(size_t count, PrototypeSlab &slab) const = 0;
+  virtual void Method(float prototype_field) = 0;
+  /**
+   * Snapshot support: the kind tells which class has to load the record that
+   * Save() writes.
+   */
+  virtual SnapshotKind Kind() const = 0;
+  virtual void Save(SnapshotWriter &writer) const = 0;
+};
+
+/**
+ * A CopyingPrototype keeps its fields inline, so Clone() copies all of them.
+ */
+
+class CopyingPrototype : public Prototype {
  protected:
   std::string prototype_name_;
   float prototype_field_;
 
  public:
-  Prototype() {}
-  Prototype(std::string prototype_name) : prototype_name_(prototype_name) {}
-  virtual ~Prototype() {}
-  virtual Prototype *Clone() const = 0;
-  virtual void Method(float prototype_field) {
+  CopyingPrototype() {}
+  CopyingPrototype(std::string prototype_name)
+      : prototype_name_(prototype_name), prototype_field_(0.f) {}
+  void Method(float prototype_field) override {
     prototype_field_ = prototype_field;
     std::cout << "Call Method from " << prototype_name_
               << " with field : " << prototype_field << std::endl;
   }
+
+ protected:
+  void SavePrototypeFields(SnapshotWriter &writer) const {
+    writer.WriteString(prototype_name_);
+    writer.WriteFloat(prototype_field_);
+  }
 };
 
 /**
@@ -39,13 +268,13 @@ class Prototype {
  * clone method
  */
 
-class ConcretePrototype1 : public Prototype {
+class ConcretePrototype1 : public CopyingPrototype {
  private:
   float concrete_prototype_field1_;
 
  public:
   ConcretePrototype1(std::string prototype_name, float concrete_prototype_field)
-      : Prototype(prototype_name),
+      : CopyingPrototype(prototype_name),
         concrete_prototype_field1_(concrete_prototype_field) {}
 
   /**
@@ -55,52 +284,389 @@ class ConcretePrototype1 : public Prototype {
    * use unique_pointer here.
    */
   Prototype *Clone() const override { return new ConcretePrototype1(*this); }
+  void CloneN(size_t count, PrototypeSlab &slab) const override {
+    slab.Fill(*this, count);
+  }
+
+  SnapshotKind Kind() const override { return kConcretePrototype1; }
+  void Save(SnapshotWriter &writer) const override {
+    SavePrototypeFields(writer);
+    writer.WriteFloat(concrete_prototype_field1_);
+  }
+  static Prototype *Load(SnapshotReader &reader) {
+    std::string prototype_name = reader.ReadString();
+    float prototype_field = reader.ReadFloat();
+    ConcretePrototype1 *prototype =
+        new ConcretePrototype1(prototype_name, reader.ReadFloat());
+    prototype->prototype_field_ = prototype_field;
+    return prototype;
+  }
 };
 
-class ConcretePrototype2 : public Prototype {
+class ConcretePrototype2 : public CopyingPrototype {
  private:
   float concrete_prototype_field2_;
 
  public:
   ConcretePrototype2(std::string prototype_name, float concrete_prototype_field)
-      : Prototype(prototype_name),
+      : CopyingPrototype(prototype_name),
         concrete_prototype_field2_(concrete_prototype_field) {}
   Prototype *Clone() const override { return new ConcretePrototype2(*this); }
+  void CloneN(size_t count, PrototypeSlab &slab) const override {
+    slab.Fill(*this, count);
+  }
+
+  SnapshotKind Kind() const override { return kConcretePrototype2; }
+  void Save(SnapshotWriter &writer) const override {
+    SavePrototypeFields(writer);
+    writer.WriteFloat(concrete_prototype_field2_);
+  }
+  static Prototype *Load(SnapshotReader &reader) {
+    std::string prototype_name = reader.ReadString();
+    float prototype_field = reader.ReadFloat();
+    ConcretePrototype2 *prototype =
+        new ConcretePrototype2(prototype_name, reader.ReadFloat());
+    prototype->prototype_field_ = prototype_field;
+    return prototype;
+  }
+};
+
+/**
+ * Most clones never change the fields they were copied with, yet Clone() copies
+ * all of them, including the name. A CowPrototype keeps its fields in a
+ * reference-counted payload instead: a clone only shares the payload of its
+ * original, and gets a private copy the first time it is changed through
+ * Method(). This is the copy-on-write idea. A clone is just the vtable pointer
+ * and the shared_ptr.
+ */
+
+class CowPrototype : public Prototype {
+ private:
+  struct Payload {
+    std::string prototype_name_;
+    float prototype_field_;
+    float concrete_prototype_field_;
+  };
+  std::shared_ptr<Payload> payload_;
+
+ public:
+  CowPrototype(std::string prototype_name, float concrete_prototype_field)
+      : payload_(std::make_shared<Payload>(
+            Payload{prototype_name, 0.f, concrete_prototype_field})) {}
+
+  Prototype *Clone() const override { return new CowPrototype(*this); }
+  void CloneN(size_t count, PrototypeSlab &slab) const override {
+    slab.Fill(*this, count);
+  }
+
+  void Method(float prototype_field) override {
+    if (payload_.use_count() > 1) {
+      payload_ = std::make_shared<Payload>(*payload_);
+    }
+    payload_->prototype_field_ = prototype_field;
+    std::cout << "Call Method from " << payload_->prototype_name_
+              << " with field : " << prototype_field << std::endl;
+  }
+
+  bool SharesPayloadWith(const CowPrototype &other) const {
+    return payload_ == other.payload_;
+  }
+
+  SnapshotKind Kind() const override { return kCowPrototype; }
+  void Save(SnapshotWriter &writer) const override {
+    writer.WriteString(payload_->prototype_name_);
+    writer.WriteFloat(payload_->prototype_field_);
+    writer.WriteFloat(payload_->concrete_prototype_field_);
+  }
+  static Prototype *Load(SnapshotReader &reader) {
+    std::string prototype_name = reader.ReadString();
+    float prototype_field = reader.ReadFloat();
+    CowPrototype *prototype =
+        new CowPrototype(prototype_name, reader.ReadFloat());
+    prototype->payload_->prototype_field_ = prototype_field;
+    return prototype;
+  }
+};
+
+Prototype *LoadPrototype(SnapshotKind kind, SnapshotReader &reader) {
+  switch (kind) {
+    case kConcretePrototype1:
+      return ConcretePrototype1::Load(reader);
+    case kConcretePrototype2:
+      return ConcretePrototype2::Load(reader);
+    case kCowPrototype:
+      return CowPrototype::Load(reader);
+    default:
+      throw std::runtime_error("Prototype snapshot has an unknown kind");
+  }
+}
+
+/**
+ * A MappedSnapshot maps a snapshot file into memory and only checks its header
+ * up front. A prototype is read from the mapped image when it is asked for, so
+ * only the pages of prototypes that are actually used are ever touched.
+ */
+class MappedSnapshot {
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  uint32_t slot_count_ = 0;
+
+ public:
+  explicit MappedSnapshot(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Can't open prototype snapshot " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      throw std::runtime_error("Can't stat prototype snapshot " + path);
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    void *data = size_ == 0
+                     ? MAP_FAILED
+                     : mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Can't map prototype snapshot " + path);
+    }
+    data_ = static_cast<const char *>(data);
+    if (size_ < kSnapshotHeaderSize) {
+      munmap(const_cast<char *>(data_), size_);
+      throw std::runtime_error("Not a prototype snapshot: " + path);
+    }
+
+    SnapshotReader header(data_, size_);
+    char magic[sizeof(kSnapshotMagic)];
+    header.ReadBytes(magic, sizeof(magic));
+    if (std::memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0 ||
+        header.ReadUint32() != kSnapshotVersion) {
+      munmap(const_cast<char *>(data_), size_);
+      throw std::runtime_error("Not a prototype snapshot: " + path);
+    }
+    slot_count_ = header.ReadUint32();
+    if ((size_ - kSnapshotHeaderSize) / kSnapshotSlotSize < slot_count_) {
+      munmap(const_cast<char *>(data_), size_);
+      throw std::runtime_error("Prototype snapshot is truncated");
+    }
+  }
+  MappedSnapshot(const MappedSnapshot &) = delete;
+  MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+  ~MappedSnapshot() { munmap(const_cast<char *>(data_), size_); }
+
+  size_t slot_count() const { return slot_count_; }
+
+  /**
+   * Returns a new prototype loaded from the slot of this type, or nullptr if
+   * the snapshot holds none.
+   */
+  Prototype *Load(size_t index) const {
+    if (index >= slot_count_) {
+      return nullptr;
+    }
+    SnapshotReader slot(data_ + kSnapshotHeaderSize + index * kSnapshotSlotSize,
+                        kSnapshotSlotSize);
+    SnapshotKind kind = static_cast<SnapshotKind>(slot.ReadUint32());
+    uint32_t size = slot.ReadUint32();
+    uint64_t offset = slot.ReadUint64();
+    if (kind == kNoPrototype) {
+      return nullptr;
+    }
+    if (offset > size_ || size > size_ - offset) {
+      throw std::runtime_error("Prototype snapshot is truncated");
+    }
+    SnapshotReader record(data_ + offset, size);
+    return LoadPrototype(kind, record);
+  }
 };
 
 /**
  * In PrototypeFactory you have two concrete prototypes, one for each concrete
  * prototype class, so each time you want to create a bullet , you can use the
  * existing ones and clone those.
+ *
+ * Type is a small dense enum, so the prototypes are kept in a flat array
+ * indexed by the type rather than in a hash map: a lookup is a bounds check and
+ * a load. New prototypes can be registered at runtime under any further type
+ * value, and the array grows to fit.
  */
 
 class PrototypeFactory {
  private:
-  std::unordered_map<Type, Prototype *, std::hash<int>> prototypes_;
+  /**
+   * Prototypes loaded from the snapshot are cached in their slot on first use,
+   * which is why a const factory may still fill one in. The once_flag makes
+   * that safe when several threads clone from the same const factory.
+   *
+   * Slots are allocated a chunk at a time, when a type in the chunk is first
+   * asked for, so startup only zeroes one pointer per kSlotsPerChunk types.
+   */
+  struct SnapshotSlot {
+    std::once_flag loaded_;
+    Prototype *prototype_ = nullptr;
+  };
+  static constexpr size_t kSlotsPerChunk = 64;
+  struct SnapshotChunk {
+    SnapshotSlot slots_[kSlotsPerChunk];
+  };
+
+  std::vector<Prototype *> prototypes_;
+  std::unique_ptr<MappedSnapshot> snapshot_;
+  size_t snapshot_chunk_count_ = 0;
+  std::unique_ptr<std::atomic<SnapshotChunk *>[]> snapshot_chunks_;
 
  public:
   PrototypeFactory() {
-    prototypes_[Type::PROTOTYPE_1] =
-        new ConcretePrototype1("PROTOTYPE_1 ", 50.f);
-    prototypes_[Type::PROTOTYPE_2] =
-        new ConcretePrototype2("PROTOTYPE_2 ", 60.f);
+    Register(Type::PROTOTYPE_1, new ConcretePrototype1("PROTOTYPE_1 ", 50.f));
+    Register(Type::PROTOTYPE_2, new ConcretePrototype2("PROTOTYPE_2 ", 60.f));
   }
 
+  /**
+   * Instead of building every prototype by hand, the factory can start from a
+   * snapshot written by SaveSnapshot(). Startup only maps the file; each
+   * prototype is loaded the first time its type is asked for. Prototypes
+   * registered later take precedence over the snapshot.
+   */
+  explicit PrototypeFactory(const std::string &snapshot_path)
+      : snapshot_(new MappedSnapshot(snapshot_path)),
+        snapshot_chunk_count_((snapshot_->slot_count() + kSlotsPerChunk - 1) /
+                              kSlotsPerChunk),
+        snapshot_chunks_(
+            new std::atomic<SnapshotChunk *>[snapshot_chunk_count_]()) {}
+
   /**
    * Be carefull of free all memory allocated. Again, if you have smart pointers
    * knowelege will be better to use it here.
    */
 
   ~PrototypeFactory() {
-    delete prototypes_[Type::PROTOTYPE_1];
-    delete prototypes_[Type::PROTOTYPE_2];
+    for (Prototype *prototype : prototypes_) {
+      delete prototype;
+    }
+    for (size_t i = 0; i < snapshot_chunk_count_; i++) {
+      SnapshotChunk *chunk = snapshot_chunks_[i].load();
+      if (chunk == nullptr) {
+        continue;
+      }
+      for (SnapshotSlot &slot : chunk->slots_) {
+        delete slot.prototype_;
+      }
+      delete chunk;
+    }
+  }
+
+  /**
+   * The factory takes ownership of the prototype. Registering a type again
+   * replaces (and frees) its previous prototype. Negative types throw
+   * std::out_of_range.
+   */
+  void Register(Type type, Prototype *prototype) {
+    if (static_cast<int>(type) < 0) {
+      delete prototype;
+      throw std::out_of_range("PrototypeFactory: negative prototype type");
+    }
+    size_t index = static_cast<size_t>(type);
+    if (index >= prototypes_.size()) {
+      prototypes_.resize(index + 1, nullptr);
+    }
+    delete prototypes_[index];
+    prototypes_[index] = prototype;
   }
 
   /**
    * Notice here that you just need to specify the type of the prototype you
-   * want and the method will create from the object with this type.
+   * want and the method will create from the object with this type. Asking for
+   * a type that was never registered throws std::out_of_range.
    */
-  Prototype *CreatePrototype(Type type) { return prototypes_[type]->Clone(); }
+  Prototype *CreatePrototype(Type type) const {
+    return Find(type).Clone();
+  }
+
+  /**
+   * Stamps out `count` copies of the prototype of this type into `slab`.
+   */
+  void CreatePrototypes(Type type, size_t count, PrototypeSlab &slab) const {
+    Find(type).CloneN(count, slab);
+  }
+
+  /**
+   * Writes every prototype of this factory, including the ones it could still
+   * load from its own snapshot, into a snapshot file.
+   */
+  void SaveSnapshot(const std::string &path) const {
+    size_t slot_count = prototypes_.size();
+    if (snapshot_ && snapshot_->slot_count() > slot_count) {
+      slot_count = snapshot_->slot_count();
+    }
+    std::string records;
+    SnapshotWriter record_writer(records);
+    std::string slots;
+    SnapshotWriter slot_writer(slots);
+    uint64_t records_start =
+        kSnapshotHeaderSize + slot_count * kSnapshotSlotSize;
+    for (size_t index = 0; index < slot_count; index++) {
+      const Prototype *prototype = TryFind(index);
+      size_t offset = records.size();
+      if (prototype != nullptr) {
+        prototype->Save(record_writer);
+      }
+      slot_writer.WriteUint32(prototype ? prototype->Kind() : kNoPrototype);
+      slot_writer.WriteUint32(static_cast<uint32_t>(records.size() - offset));
+      slot_writer.WriteUint64(records_start + offset);
+    }
+
+    std::string header;
+    SnapshotWriter header_writer(header);
+    header_writer.WriteBytes(kSnapshotMagic, sizeof(kSnapshotMagic));
+    header_writer.WriteUint32(kSnapshotVersion);
+    header_writer.WriteUint32(static_cast<uint32_t>(slot_count));
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file << header << slots << records;
+    if (!file.flush()) {
+      throw std::runtime_error("Can't write prototype snapshot " + path);
+    }
+  }
+
+ private:
+  SnapshotSlot &GetSnapshotSlot(size_t index) const {
+    std::atomic<SnapshotChunk *> &entry =
+        snapshot_chunks_[index / kSlotsPerChunk];
+    SnapshotChunk *chunk = entry.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+      SnapshotChunk *fresh = new SnapshotChunk;
+      if (entry.compare_exchange_strong(chunk, fresh,
+                                        std::memory_order_acq_rel,
+                                        std::memory_order_acquire)) {
+        chunk = fresh;
+      } else {
+        delete fresh;
+      }
+    }
+    return chunk->slots_[index % kSlotsPerChunk];
+  }
+
+  const Prototype *TryFind(size_t index) const {
+    if (index < prototypes_.size() && prototypes_[index] != nullptr) {
+      return prototypes_[index];
+    }
+    if (!snapshot_ || index >= snapshot_->slot_count()) {
+      return nullptr;
+    }
+    SnapshotSlot &slot = GetSnapshotSlot(index);
+    std::call_once(slot.loaded_,
+                   [&]() { slot.prototype_ = snapshot_->Load(index); });
+    return slot.prototype_;
+  }
+
+  const Prototype &Find(Type type) const {
+    const Prototype *prototype = TryFind(static_cast<size_t>(type));
+    if (prototype == nullptr) {
+      throw std::out_of_range("PrototypeFactory: unknown prototype type");
+    }
+    return *prototype;
+  }
 };
 
 void Client(PrototypeFactory &prototype_factory) {
@@ -120,10 +686,243 @@ void Client(PrototypeFactory &prototype_factory) {
   delete prototype;
 }
 
+/**
+ * Clones prototypes picked by type, first looking them up in a hash map the way
+ * the factory used to, and then through the factory's flat array.
+ */
+void BenchmarkClones(const PrototypeFactory &prototype_factory) {
+  const int kClones = 5000000;
+  std::unordered_map<Type, Prototype *, std::hash<int>> hashed;
+  hashed[Type::PROTOTYPE_1] = prototype_factory.CreatePrototype(PROTOTYPE_1);
+  hashed[Type::PROTOTYPE_2] = prototype_factory.CreatePrototype(PROTOTYPE_2);
+
+  size_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kClones; i++) {
+    Prototype *clone = hashed.at(static_cast<Type>(i & 1))->Clone();
+    checksum += reinterpret_cast<size_t>(clone) >> 4;
+    delete clone;
+  }
+  std::chrono::duration<double> hashed_time =
+      std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kClones; i++) {
+    Prototype *clone =
+        prototype_factory.CreatePrototype(static_cast<Type>(i & 1));
+    checksum += reinterpret_cast<size_t>(clone) >> 4;
+    delete clone;
+  }
+  std::chrono::duration<double> dense_time =
+      std::chrono::steady_clock::now() - start;
+
+  for (auto &entry : hashed) {
+    delete entry.second;
+  }
+  std::cout << "hash map lookup: " << kClones / hashed_time.count()
+            << " clones/s\n";
+  std::cout << "flat array:      " << kClones / dense_time.count()
+            << " clones/s\n";
+  std::cout << "(checksum " << (checksum & 0xff) << ")\n";
+}
+
+/**
+ * Stamps out many copies of one prototype, first with individual Clone() calls
+ * and then with CloneN() into a reused slab.
+ */
+void BenchmarkCloneN(const PrototypeFactory &prototype_factory) {
+  const size_t kCopies = 10000;
+  const int kRounds = 200;
+  std::vector<Prototype *> clones(kCopies);
+  size_t checksum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < kRounds; round++) {
+    for (size_t i = 0; i < kCopies; i++) {
+      clones[i] = prototype_factory.CreatePrototype(Type::PROTOTYPE_1);
+    }
+    checksum += reinterpret_cast<size_t>(clones[round % kCopies]) >> 4;
+    for (Prototype *clone : clones) {
+      delete clone;
+    }
+  }
+  std::chrono::duration<double> single_time =
+      std::chrono::steady_clock::now() - start;
+
+  PrototypeSlab slab;
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < kRounds; round++) {
+    prototype_factory.CreatePrototypes(Type::PROTOTYPE_1, kCopies, slab);
+    checksum += reinterpret_cast<size_t>(slab[round % kCopies]) >> 4;
+    slab.Clear();
+  }
+  std::chrono::duration<double> slab_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "Clone() one by one: " << kCopies * kRounds / single_time.count()
+            << " clones/s\n";
+  std::cout << "CloneN() in a slab: " << kCopies * kRounds / slab_time.count()
+            << " clones/s\n";
+  std::cout << "(checksum " << (checksum & 0xff) << ")\n";
+}
+
+/**
+ * Keeps many clones of a prototype with a long name alive at once, copying all
+ * fields vs. sharing them, and reports the time and heap bytes per clone.
+ */
+void BenchmarkCopyOnWrite() {
+  const size_t kClones = 1000000;
+  const std::string name(100, 'P');
+  ConcretePrototype1 copying(name, 50.f);
+  CowPrototype sharing(name, 50.f);
+
+  for (const Prototype *original :
+       {static_cast<const Prototype *>(&copying),
+        static_cast<const Prototype *>(&sharing)}) {
+    std::vector<Prototype *> clones;
+    clones.reserve(kClones);
+    size_t bytes_before = g_allocated_bytes;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kClones; i++) {
+      clones.push_back(original->Clone());
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    size_t bytes = g_allocated_bytes - bytes_before;
+    std::cout << (original == &copying ? "copying: " : "sharing: ")
+              << elapsed.count() * 1e9 / kClones << " ns and "
+              << bytes / kClones << " heap bytes per clone\n";
+    for (Prototype *clone : clones) {
+      delete clone;
+    }
+  }
+}
+
+/**
+ * Compares building a large set of prototypes by hand with starting from a
+ * snapshot of it, both with the snapshot file evicted from the page cache
+ * (cold) and still cached (warm). Only a few prototypes are used afterwards.
+ */
+void BenchmarkSnapshotStartup() {
+  const size_t kPrototypes = 50000;
+  const size_t kUsed = 10;
+  const std::string path = "prototype_snapshot.bin";
+  size_t checksum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    PrototypeFactory prototype_factory;
+    for (size_t i = 0; i < kPrototypes; i++) {
+      prototype_factory.Register(
+          static_cast<Type>(i),
+          new ConcretePrototype1(std::string(200, 'a' + i % 26), 50.f));
+    }
+    std::chrono::duration<double> by_hand =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "by hand:         " << by_hand.count() * 1e3 << " ms\n";
+    prototype_factory.SaveSnapshot(path);
+  }
+
+  for (bool cold : {true, false}) {
+    if (cold) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+      }
+    }
+    start = std::chrono::steady_clock::now();
+    PrototypeFactory prototype_factory(path);
+    for (size_t i = 0; i < kUsed; i++) {
+      Prototype *prototype = prototype_factory.CreatePrototype(
+          static_cast<Type>(i * (kPrototypes / kUsed)));
+      checksum += reinterpret_cast<size_t>(prototype) >> 4;
+      delete prototype;
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << (cold ? "snapshot (cold): " : "snapshot (warm): ")
+              << elapsed.count() * 1e3 << " ms\n";
+  }
+  std::remove(path.c_str());
+  std::cout << "(checksum " << (checksum & 0xff) << ")\n";
+}
+
 int main() {
   PrototypeFactory *prototype_factory = new PrototypeFactory();
   Client(*prototype_factory);
+
+  std::cout << "\n";
+  std::cout << "Let's register a Prototype 3 at runtime\n";
+  const Type kPrototype3 = static_cast<Type>(2);
+  prototype_factory->Register(kPrototype3,
+                              new ConcretePrototype1("PROTOTYPE_3 ", 70.f));
+  Prototype *prototype = prototype_factory->CreatePrototype(kPrototype3);
+  prototype->Method(30);
+  delete prototype;
+  try {
+    prototype_factory->CreatePrototype(static_cast<Type>(5));
+  } catch (const std::out_of_range &error) {
+    std::cout << "Asking for an unknown type fails: " << error.what() << "\n";
+  }
+
+  std::cout << "\n";
+  std::cout << "Benchmark: cloning through a hash map vs. a flat array\n";
+  BenchmarkClones(*prototype_factory);
+
+  std::cout << "\n";
+  std::cout << "Let's stamp out three copies of Prototype 2 at once\n";
+  PrototypeSlab slab;
+  prototype_factory->CreatePrototypes(Type::PROTOTYPE_2, 3, slab);
+  for (size_t i = 0; i < slab.size(); i++) {
+    slab[i]->Method(static_cast<float>(i));
+  }
+  slab.Clear();
+
+  std::cout << "\n";
+  std::cout << "Benchmark: many Clone() calls vs. one CloneN()\n";
+  BenchmarkCloneN(*prototype_factory);
   delete prototype_factory;
 
+  std::cout << "\n";
+  std::cout << "Let's clone a copy-on-write prototype\n";
+  CowPrototype cow_prototype("COW_PROTOTYPE ", 80.f);
+  CowPrototype *cow_clone = static_cast<CowPrototype *>(cow_prototype.Clone());
+  std::cout << "Shares its fields after Clone(): "
+            << cow_clone->SharesPayloadWith(cow_prototype) << "\n";
+  cow_clone->Method(40);
+  std::cout << "Shares its fields after Method(): "
+            << cow_clone->SharesPayloadWith(cow_prototype) << "\n";
+  delete cow_clone;
+
+  std::cout << "\n";
+  std::cout
+      << "Benchmark: copying vs. sharing the fields of a million clones\n";
+  BenchmarkCopyOnWrite();
+
+  std::cout << "\n";
+  std::cout << "Let's save the prototypes and start again from the snapshot\n";
+  {
+    PrototypeFactory original;
+    original.Register(static_cast<Type>(2),
+                      new CowPrototype("PROTOTYPE_3 ", 70.f));
+    original.SaveSnapshot("prototypes.bin");
+  }
+  {
+    PrototypeFactory restored("prototypes.bin");
+    prototype = restored.CreatePrototype(Type::PROTOTYPE_2);
+    prototype->Method(20);
+    delete prototype;
+    prototype = restored.CreatePrototype(static_cast<Type>(2));
+    prototype->Method(25);
+    delete prototype;
+  }
+  std::remove("prototypes.bin");
+
+  std::cout << "\n";
+  std::cout << "Benchmark: building 50000 prototypes vs. mapping a snapshot\n";
+  BenchmarkSnapshotStartup();
+
   return 0;
 }
\ No newline at end of file
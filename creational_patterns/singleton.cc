@@ -1,6 +1,19 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 /**
  * The Singleton class defines the `GetInstance` method that serves as an
  * alternative to constructor and lets clients access the same instance of this
@@ -15,9 +28,11 @@ class Singleton {
  protected:
   Singleton(const std::string value) : value_(value) {}
 
-  static Singleton* singleton_;
+  static std::atomic<Singleton*> singleton_;
+  static std::mutex mutex_;
 
   std::string value_;
+  std::atomic<uint64_t> counter_{0};
 
  public:
   /**
@@ -45,9 +60,18 @@ class Singleton {
   }
 
   std::string value() const { return value_; }
+
+  /**
+   * Global state that every thread writes, e.g. a statistics counter.
+   */
+  void AddToCounter(uint64_t amount) {
+    counter_.fetch_add(amount, std::memory_order_relaxed);
+  }
+  uint64_t counter() const { return counter_.load(std::memory_order_relaxed); }
 };
 
-Singleton* Singleton::singleton_ = nullptr;
+std::atomic<Singleton*> Singleton::singleton_{nullptr};
+std::mutex Singleton::mutex_;
 
 /**
  * Static methods should be defined outside the class.
@@ -55,14 +79,410 @@ Singleton* Singleton::singleton_ = nullptr;
 Singleton* Singleton::GetInstance(const std::string& value) {
   /**
    * This is a safer way to create an instance. instance = new Singleton is
-   * dangeruous in case two instance threads wants to access at the same time
+   * dangeruous in case two instance threads wants to access at the same time.
+   *
+   * Once the instance exists, a call is a single acquire load. Only the first
+   * callers take the lock, and the check is repeated under it so that exactly
+   * one of them creates the instance. The release store publishes the fully
+   * constructed object to the lock-free readers.
    */
-  if (singleton_ == nullptr) {
-    singleton_ = new Singleton(value);
+  Singleton* singleton = singleton_.load(std::memory_order_acquire);
+  if (singleton == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    singleton = singleton_.load(std::memory_order_relaxed);
+    if (singleton == nullptr) {
+      singleton = new Singleton(value);
+      singleton_.store(singleton, std::memory_order_release);
+    }
   }
-  return singleton_;
+  return singleton;
 }
 
+/**
+ * When every thread keeps writing to the singleton, all of them fight over the
+ * cache line that holds its state. The ShardedSingleton gives every thread a
+ * shard of its own, aligned to a cache line, so writes stay local to the
+ * writing core. Reading merges all the shards.
+ *
+ * A shard is only ever written by its own thread. A thread takes a shard when
+ * it first writes; when the thread exits, the shard's count is folded into a
+ * retired total and the shard is handed to the next new thread. The number of
+ * shards is therefore bounded by the number of threads alive at once, not by
+ * the number of threads ever created.
+ */
+class ShardedSingleton {
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> counter_{0};
+    bool in_use_ = false;
+  };
+
+  /**
+   * Gives the shard back when its thread exits.
+   */
+  struct ShardOwner {
+    ShardedSingleton* singleton_ = nullptr;
+    Shard* shard_ = nullptr;
+    ~ShardOwner() {
+      if (shard_ != nullptr) {
+        singleton_->Retire(shard_);
+      }
+    }
+  };
+
+  static std::atomic<ShardedSingleton*> singleton_;
+  static std::mutex mutex_;
+
+  mutable std::mutex shards_mutex_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  uint64_t retired_ = 0;
+
+  ShardedSingleton() {}
+
+  Shard& LocalShard() {
+    thread_local ShardOwner owner;
+    if (owner.shard_ == nullptr) {
+      std::lock_guard<std::mutex> lock(shards_mutex_);
+      for (const std::unique_ptr<Shard>& shard : shards_) {
+        if (!shard->in_use_) {
+          owner.shard_ = shard.get();
+          break;
+        }
+      }
+      if (owner.shard_ == nullptr) {
+        shards_.emplace_back(new Shard());
+        owner.shard_ = shards_.back().get();
+      }
+      owner.shard_->in_use_ = true;
+      owner.singleton_ = this;
+    }
+    return *owner.shard_;
+  }
+
+  void Retire(Shard* shard) {
+    std::lock_guard<std::mutex> lock(shards_mutex_);
+    retired_ += shard->counter_.load(std::memory_order_relaxed);
+    shard->counter_.store(0, std::memory_order_relaxed);
+    shard->in_use_ = false;
+  }
+
+ public:
+  ShardedSingleton(ShardedSingleton& other) = delete;
+  void operator=(const ShardedSingleton&) = delete;
+
+  static ShardedSingleton* GetInstance();
+
+  /**
+   * Only the calling thread writes its shard, so a plain load and store is
+   * enough; the atomic just makes concurrent reads by counter() well defined.
+   */
+  void AddToCounter(uint64_t amount) {
+    std::atomic<uint64_t>& counter = LocalShard().counter_;
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+  }
+
+  /**
+   * Merges the shards of all live threads with the counts of exited ones.
+   */
+  uint64_t counter() const {
+    std::lock_guard<std::mutex> lock(shards_mutex_);
+    uint64_t total = retired_;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+      total += shard->counter_.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  size_t shard_count() const {
+    std::lock_guard<std::mutex> lock(shards_mutex_);
+    return shards_.size();
+  }
+};
+
+std::atomic<ShardedSingleton*> ShardedSingleton::singleton_{nullptr};
+std::mutex ShardedSingleton::mutex_;
+
+ShardedSingleton* ShardedSingleton::GetInstance() {
+  ShardedSingleton* singleton = singleton_.load(std::memory_order_acquire);
+  if (singleton == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    singleton = singleton_.load(std::memory_order_relaxed);
+    if (singleton == nullptr) {
+      singleton = new ShardedSingleton();
+      singleton_.store(singleton, std::memory_order_release);
+    }
+  }
+  return singleton;
+}
+
+/**
+ * A real process has many singletons, and which one gets initialized first,
+ * and how long it takes, is usually invisible. The SingletonRegistry makes it
+ * explicit: every singleton is registered under a name together with the names
+ * of the singletons it depends on, and is created through the registry.
+ *
+ * A singleton is created the first time it is asked for, after its
+ * dependencies. Singletons registered as eager are created by InitializeEager()
+ * instead, on several threads, so independent ones are initialized in
+ * parallel. Every initialization is timed, and Profile() reports when each
+ * singleton started and how long its own initialization took.
+ *
+ * All singletons must be registered before the first one is created. The
+ * dependency graph is checked when the first singleton is created, so unknown
+ * dependencies and cycles are reported instead of deadlocking.
+ */
+class SingletonRegistry {
+ public:
+  struct Entry {
+    std::string name_;
+    std::vector<std::string> dependencies_;
+    std::function<void*()> create_;
+    bool eager_;
+    std::atomic<void*> instance_{nullptr};
+    std::once_flag once_;
+    double start_ms_ = 0;
+    double duration_ms_ = 0;
+  };
+
+ private:
+  std::vector<std::unique_ptr<Entry>> entries_;
+  std::unordered_map<std::string, Entry*> by_name_;
+  std::once_flag validated_;
+  std::chrono::steady_clock::time_point epoch_ =
+      std::chrono::steady_clock::now();
+
+  Entry& Lookup(const std::string& name) const {
+    auto it = by_name_.find(name);
+    if (it == by_name_.end()) {
+      throw std::logic_error("SingletonRegistry: unknown singleton " + name);
+    }
+    return *it->second;
+  }
+
+  double Now() const {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - epoch_)
+        .count();
+  }
+
+  void* Initialize(Entry& entry) {
+    // A cycle would make call_once below wait for itself.
+    std::call_once(validated_, [this]() { DependencyOrder(); });
+    std::call_once(entry.once_, [this, &entry]() {
+      for (const std::string& dependency : entry.dependencies_) {
+        Initialize(Lookup(dependency));
+      }
+      entry.start_ms_ = Now();
+      void* instance = entry.create_();
+      entry.duration_ms_ = Now() - entry.start_ms_;
+      entry.instance_.store(instance, std::memory_order_release);
+    });
+    return entry.instance_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Returns the entries so that every singleton comes after its dependencies,
+   * and rejects unknown dependencies and cycles.
+   */
+  std::vector<Entry*> DependencyOrder() const {
+    std::unordered_map<const Entry*, int> state;  // 1: visiting, 2: done
+    std::vector<Entry*> order;
+    std::function<void(Entry&)> visit = [&](Entry& entry) {
+      int& mark = state[&entry];
+      if (mark == 2) {
+        return;
+      }
+      if (mark == 1) {
+        throw std::logic_error("SingletonRegistry: dependency cycle at " +
+                               entry.name_);
+      }
+      mark = 1;
+      for (const std::string& dependency : entry.dependencies_) {
+        visit(Lookup(dependency));
+      }
+      state[&entry] = 2;
+      order.push_back(&entry);
+    };
+    for (const std::unique_ptr<Entry>& entry : entries_) {
+      visit(*entry);
+    }
+    return order;
+  }
+
+ public:
+  static SingletonRegistry& Global() {
+    static SingletonRegistry registry;
+    return registry;
+  }
+
+  /**
+   * The returned entry is a handle for fast access through Get().
+   */
+  Entry* Register(const std::string& name,
+                  std::vector<std::string> dependencies,
+                  std::function<void*()> create, bool eager) {
+    if (by_name_.count(name) != 0) {
+      throw std::logic_error("SingletonRegistry: duplicate singleton " + name);
+    }
+    entries_.emplace_back(new Entry());
+    Entry* entry = entries_.back().get();
+    entry->name_ = name;
+    entry->dependencies_ = std::move(dependencies);
+    entry->create_ = std::move(create);
+    entry->eager_ = eager;
+    by_name_[name] = entry;
+    return entry;
+  }
+
+  /**
+   * Once the singleton exists, this is a single acquire load.
+   */
+  template <typename T>
+  T* Get(Entry* entry) {
+    void* instance = entry->instance_.load(std::memory_order_acquire);
+    return static_cast<T*>(instance ? instance : Initialize(*entry));
+  }
+
+  template <typename T>
+  T* Get(const std::string& name) {
+    return Get<T>(&Lookup(name));
+  }
+
+  /**
+   * Creates all eager singletons and their dependencies on `threads` threads.
+   * A singleton is only handed to a worker once all its dependencies exist, so
+   * workers never wait on each other while independent work is left. If a
+   * singleton fails to initialize, no further ones are started and the first
+   * exception is rethrown once all workers have stopped.
+   */
+  void InitializeEager(size_t threads) {
+    // Collect the eager singletons and everything they depend on, in
+    // dependency order.
+    std::vector<Entry*> order = DependencyOrder();
+    std::unordered_map<const Entry*, size_t> needed;
+    for (size_t i = order.size(); i > 0; i--) {
+      Entry* entry = order[i - 1];
+      if (entry->eager_ || needed.count(entry) != 0) {
+        needed[entry] = 0;
+        for (const std::string& dependency : entry->dependencies_) {
+          needed[&Lookup(dependency)] = 0;
+        }
+      }
+    }
+    order.erase(std::remove_if(order.begin(), order.end(),
+                               [&needed](Entry* entry) {
+                                 return needed.count(entry) == 0;
+                               }),
+                order.end());
+
+    // pending[i] counts the dependencies of order[i] that don't exist yet.
+    std::vector<size_t> pending(order.size(), 0);
+    std::vector<std::vector<size_t>> dependents(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      needed[order[i]] = i;
+    }
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < order.size(); i++) {
+      for (const std::string& dependency : order[i]->dependencies_) {
+        Entry& dependency_entry = Lookup(dependency);
+        if (dependency_entry.instance_.load() == nullptr) {
+          pending[i]++;
+          dependents[needed[&dependency_entry]].push_back(i);
+        }
+      }
+      if (pending[i] == 0) {
+        ready.push_back(i);
+      }
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t remaining = order.size();
+    std::exception_ptr error;
+    auto worker = [&]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        changed.wait(lock, [&]() {
+          return !ready.empty() || remaining == 0 || error != nullptr;
+        });
+        if (ready.empty() || error != nullptr) {
+          return;
+        }
+        size_t i = ready.back();
+        ready.pop_back();
+        lock.unlock();
+        try {
+          Initialize(*order[i]);
+        } catch (...) {
+          lock.lock();
+          if (error == nullptr) {
+            error = std::current_exception();
+          }
+          changed.notify_all();
+          return;
+        }
+        lock.lock();
+        remaining--;
+        for (size_t dependent : dependents[i]) {
+          if (--pending[dependent] == 0) {
+            ready.push_back(dependent);
+          }
+        }
+        changed.notify_all();
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+      workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& w : workers) {
+      w.join();
+    }
+    if (error != nullptr) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  /**
+   * Lists the created singletons in the order they started initializing.
+   */
+  void Profile(std::ostream& out) const {
+    std::vector<const Entry*> created;
+    for (const std::unique_ptr<Entry>& entry : entries_) {
+      if (entry->instance_.load(std::memory_order_acquire) != nullptr) {
+        created.push_back(entry.get());
+      }
+    }
+    std::sort(created.begin(), created.end(),
+              [](const Entry* a, const Entry* b) {
+                return a->start_ms_ < b->start_ms_;
+              });
+    for (const Entry* entry : created) {
+      out << std::setw(10) << entry->name_ << "  started at " << std::fixed
+          << std::setprecision(1) << std::setw(6) << entry->start_ms_
+          << " ms, took " << std::setw(5) << entry->duration_ms_ << " ms\n";
+    }
+    out.unsetf(std::ios::floatfield);
+    out << std::setprecision(6);
+  }
+};
+
+/**
+ * An example of a singleton with an expensive initialization.
+ */
+class Service {
+ private:
+  std::string name_;
+
+ public:
+  Service(const std::string& name, int init_ms) : name_(name) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(init_ms));
+  }
+  std::string name() const { return name_; }
+};
+
 void ThreadFoo() {
   // Following code emulates slow initialization.
   std::this_thread::sleep_for(std::chrono::milliseconds(1000));
@@ -77,6 +497,111 @@ void ThreadBar() {
   std::cout << singleton->value() << "\n";
 }
 
+/**
+ * Hammers GetInstance from an increasing number of threads.
+ */
+void BenchmarkGetInstance() {
+  const int kCalls = 2000000;
+  for (int threads : {1, 2, 4, 8, 16}) {
+    std::atomic<size_t> checksum{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([&checksum]() {
+        size_t local = 0;
+        for (int i = 0; i < kCalls; i++) {
+          local += reinterpret_cast<size_t>(Singleton::GetInstance("BENCH"));
+        }
+        checksum += local;
+      });
+    }
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << threads << " thread(s): "
+              << threads * static_cast<double>(kCalls) / elapsed.count()
+              << " calls/s\n";
+  }
+}
+
+/**
+ * Runs `writes` counter updates on each of `threads` threads and returns the
+ * total number of updates per second.
+ */
+template <typename Write>
+double MeasureWrites(int threads, int writes, Write write) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([writes, &write]() {
+      for (int i = 0; i < writes; i++) {
+        write();
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return threads * static_cast<double>(writes) / elapsed.count();
+}
+
+void BenchmarkShardedWrites() {
+  const int kWrites = 1000000;
+  Singleton* single = Singleton::GetInstance("BENCH");
+  ShardedSingleton* sharded = ShardedSingleton::GetInstance();
+  int total_threads = 0;
+  for (int threads : {1, 2, 4, 8, 16, 32}) {
+    total_threads += threads;
+    double single_rate = MeasureWrites(
+        threads, kWrites, [single]() { single->AddToCounter(1); });
+    double sharded_rate = MeasureWrites(
+        threads, kWrites, [sharded]() { sharded->AddToCounter(1); });
+    std::cout << threads << " thread(s): " << single_rate
+              << " writes/s single, " << sharded_rate << " writes/s sharded\n";
+  }
+  std::cout << "(totals " << single->counter() << ", " << sharded->counter()
+            << "; " << sharded->shard_count() << " shards for "
+            << total_threads << " threads)\n";
+}
+
+/**
+ * Checks that a dependency cycle makes Get() throw instead of deadlocking, and
+ * that a failing eager singleton is reported by InitializeEager().
+ */
+bool CheckRegistryErrors() {
+  auto none = []() -> void* { return new int(0); };
+  bool cycle_reported = false;
+  SingletonRegistry cyclic;
+  SingletonRegistry::Entry* a = cyclic.Register("A", {"B"}, none, false);
+  cyclic.Register("B", {"A"}, none, false);
+  try {
+    cyclic.Get<int>(a);
+  } catch (const std::logic_error& e) {
+    std::cout << "Get() on a cycle: " << e.what() << "\n";
+    cycle_reported = true;
+  }
+
+  bool failure_reported = false;
+  SingletonRegistry failing;
+  failing.Register("Good", {}, none, true);
+  failing.Register(
+      "Bad", {},
+      []() -> void* { throw std::runtime_error("Bad failed to start"); }, true);
+  failing.Register("AfterBad", {"Bad"}, none, true);
+  try {
+    failing.InitializeEager(4);
+  } catch (const std::runtime_error& e) {
+    std::cout << "InitializeEager() with a failing singleton: " << e.what()
+              << "\n";
+    failure_reported = true;
+  }
+  return cycle_reported && failure_reported;
+}
+
 int main() {
   std::cout << "If you see the same value, then singleton was reused (yay!\n"
             << "If you see different values, then 2 singletons were created "
@@ -87,5 +612,29 @@ int main() {
   t1.join();
   t2.join();
 
-  return 0;
+  std::cout << "\nBenchmark: calling GetInstance from 1 to 16 threads\n";
+  BenchmarkGetInstance();
+
+  std::cout << "\nBenchmark: writing global counters from 1 to 32 threads\n";
+  BenchmarkShardedWrites();
+
+  std::cout << "\nStarting up a registry of singletons with dependencies:\n";
+  SingletonRegistry& registry = SingletonRegistry::Global();
+  auto service = [](const std::string& name, int init_ms) {
+    return [name, init_ms]() -> void* { return new Service(name, init_ms); };
+  };
+  registry.Register("Config", {}, service("Config", 30), true);
+  registry.Register("Logger", {"Config"}, service("Logger", 20), true);
+  registry.Register("Database", {"Config", "Logger"}, service("Database", 50),
+                    true);
+  registry.Register("Cache", {}, service("Cache", 40), true);
+  SingletonRegistry::Entry* reports = registry.Register(
+      "Reports", {"Database"}, service("Reports", 10), false);
+  registry.InitializeEager(2);
+  std::cout << "Lazy singleton on first use: "
+            << registry.Get<Service>(reports)->name() << "\n";
+  registry.Profile(std::cout);
+
+  std::cout << "\nReporting registry errors:\n";
+  return CheckRegistryErrors() ? 0 : 1;
 }
\ No newline at end of file
@@ -1,6 +1,19 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ADAPTER_HAS_X86_KERNELS 1
+#endif
+
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
+#include <list>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 /**
  * The Target defines the domain-specific interface used by the client code.
  */
@@ -25,6 +38,100 @@ class Adaptee {
   }
 };
 
+/**
+ * The translation reverses the adaptee's output, which can be large. The
+ * reversal is done by one of several kernels, each writing the bytes of `in`
+ * in reverse order to `out`: a portable scalar one, and on x86 an SSSE3 and an
+ * AVX2 one that reverse 16 or 32 bytes at a time with a byte shuffle. The best
+ * kernel the CPU supports is picked once, at startup.
+ */
+using ReverseKernel = void (*)(const char *in, size_t size, char *out);
+
+void ReverseScalar(const char *in, size_t size, char *out) {
+  std::reverse_copy(in, in + size, out);
+}
+
+#ifdef ADAPTER_HAS_X86_KERNELS
+__attribute__((target("ssse3"))) void ReverseSsse3(const char *in,
+                                                    size_t size, char *out) {
+  const __m128i reverse =
+      _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  size_t done = 0;
+  for (; done + 16 <= size; done += 16) {
+    __m128i block = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(in + size - done - 16));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + done),
+                     _mm_shuffle_epi8(block, reverse));
+  }
+  ReverseScalar(in, size - done, out + done);
+}
+
+__attribute__((target("avx2"))) void ReverseAvx2(const char *in, size_t size,
+                                                 char *out) {
+  // The shuffle reverses each 128-bit lane; swapping the lanes completes it.
+  const __m256i reverse = _mm256_setr_epi8(
+      15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11,
+      10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  size_t done = 0;
+  for (; done + 32 <= size; done += 32) {
+    __m256i block = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(in + size - done - 32));
+    block = _mm256_shuffle_epi8(block, reverse);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + done),
+                        _mm256_permute2x128_si256(block, block, 1));
+  }
+  // Every AVX2 CPU has SSSE3, which takes care of a remaining 16-byte block.
+  ReverseSsse3(in, size - done, out + done);
+}
+#endif
+
+struct NamedReverseKernel {
+  const char *name_;
+  ReverseKernel kernel_;
+};
+
+/**
+ * Every kernel this CPU can run, fastest first.
+ */
+std::vector<NamedReverseKernel> SupportedReverseKernels() {
+  std::vector<NamedReverseKernel> kernels;
+#ifdef ADAPTER_HAS_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.push_back({"avx2", &ReverseAvx2});
+  }
+  if (__builtin_cpu_supports("ssse3")) {
+    kernels.push_back({"ssse3", &ReverseSsse3});
+  }
+#endif
+  kernels.push_back({"scalar", &ReverseScalar});
+  return kernels;
+}
+
+const NamedReverseKernel &BestReverseKernel() {
+  static const NamedReverseKernel best = SupportedReverseKernels().front();
+  return best;
+}
+
+/**
+ * Appends the translation of `specific_request` to `out`, which is resized
+ * once to fit the prefix and the reversed payload, and then filled in place.
+ */
+void AppendTranslation(std::string_view specific_request, std::string &out) {
+  static const char kPrefix[] = "Adapter: (TRANSLATED) ";
+  const size_t prefix_size = sizeof(kPrefix) - 1;
+  const size_t start = out.size();
+  out.resize(start + prefix_size + specific_request.size());
+  std::memcpy(&out[start], kPrefix, prefix_size);
+  BestReverseKernel().kernel_(specific_request.data(), specific_request.size(),
+                              &out[start + prefix_size]);
+}
+
+void Translate(const std::string &specific_request, std::string &out) {
+  out.clear();
+  AppendTranslation(specific_request, out);
+}
+
 /**
  * The Adapter makes the Adaptee's interface compatible with the Target's
  * interface.
@@ -36,9 +143,169 @@ class Adapter : public Target {
  public:
   Adapter(Adaptee *adaptee) : adaptee_(adaptee) {}
   std::string Request() const override {
-    std::string to_reverse = adaptee_->SpecificRequest();
-    std::reverse(to_reverse.begin(), to_reverse.end());
-    return "Adapter: (TRANSLATED) " + to_reverse;
+    std::string translated;
+    Translate(adaptee_->SpecificRequest(), translated);
+    return translated;
+  }
+};
+
+/**
+ * The adaptee usually answers with the same output again and again, yet the
+ * Adapter translates it from scratch on every call. The CachingAdapter
+ * remembers the translations of the last `capacity` distinct adaptee outputs,
+ * evicting the least recently used ones when it is full, and counts how often
+ * a translation could be reused.
+ *
+ * Since adaptee outputs can be large, the cache is also bounded by the bytes it
+ * holds: an entry costs the size of the output plus the size of its
+ * translation, and the total stays within `max_bytes`. An output is stored
+ * once, in the list; the index is keyed by a view of it.
+ *
+ * Request() is const, like in Target, so the cache is mutable. The adapter is
+ * not meant to be shared between threads.
+ */
+class CachingAdapter : public Target {
+ private:
+  Adaptee *adaptee_;
+  size_t capacity_;
+  size_t max_bytes_;
+  // Pairs of adaptee output and translation, most recently used first.
+  using Entries = std::list<std::pair<std::string, std::string>>;
+  mutable Entries entries_;
+  mutable std::unordered_map<std::string_view, Entries::iterator> index_;
+  mutable size_t bytes_ = 0;
+  mutable size_t hits_ = 0;
+  mutable size_t misses_ = 0;
+
+  static size_t EntryBytes(const Entries::value_type &entry) {
+    return entry.first.size() + entry.second.size();
+  }
+
+ public:
+  CachingAdapter(Adaptee *adaptee, size_t capacity, size_t max_bytes)
+      : adaptee_(adaptee), capacity_(capacity), max_bytes_(max_bytes) {}
+
+  std::string Request() const override {
+    std::string specific_request = adaptee_->SpecificRequest();
+    auto found = index_.find(specific_request);
+    if (found != index_.end()) {
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, found->second);
+      return found->second->second;
+    }
+    ++misses_;
+    std::string translated;
+    Translate(specific_request, translated);
+    size_t entry_bytes = specific_request.size() + translated.size();
+    if (capacity_ == 0 || entry_bytes > max_bytes_) {
+      return translated;
+    }
+    while (!entries_.empty() && (entries_.size() == capacity_ ||
+                                 bytes_ + entry_bytes > max_bytes_)) {
+      bytes_ -= EntryBytes(entries_.back());
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    entries_.emplace_front(std::move(specific_request), translated);
+    bytes_ += entry_bytes;
+    index_[entries_.front().first] = entries_.begin();
+    return translated;
+  }
+
+  size_t bytes() const { return bytes_; }
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+  double hit_rate() const {
+    size_t requests = hits_ + misses_;
+    return requests == 0 ? 0 : static_cast<double>(hits_) / requests;
+  }
+};
+
+/**
+ * Adapting a whole stream of adaptee records one Request() at a time costs a
+ * virtual call and a fresh string per record. The StreamingAdapter instead
+ * collects the translations of up to `batch_size` records in one buffer and
+ * hands them to a RecordSink as a single TranslatedBatch. The buffer is reused
+ * for the next batch, so in the steady state a record costs neither a call
+ * through the sink's vtable nor an allocation.
+ */
+class TranslatedBatch {
+ private:
+  std::string data_;
+  std::vector<size_t> ends_;
+
+ public:
+  size_t size() const { return ends_.size(); }
+  std::string_view operator[](size_t index) const {
+    size_t begin = index == 0 ? 0 : ends_[index - 1];
+    return std::string_view(data_).substr(begin, ends_[index] - begin);
+  }
+  void Add(std::string_view specific_request) {
+    AppendTranslation(specific_request, data_);
+    ends_.push_back(data_.size());
+  }
+  void Clear() {
+    data_.clear();
+    ends_.clear();
+  }
+};
+
+class RecordSink {
+ public:
+  virtual ~RecordSink() = default;
+  virtual void Consume(const TranslatedBatch &batch) = 0;
+};
+
+class StreamingAdapter {
+ private:
+  RecordSink *sink_;
+  size_t batch_size_;
+  TranslatedBatch batch_;
+
+ public:
+  StreamingAdapter(RecordSink *sink, size_t batch_size)
+      : sink_(sink), batch_size_(batch_size == 0 ? 1 : batch_size) {}
+  ~StreamingAdapter() { Flush(); }
+
+  /**
+   * Adapts one record of the stream. The sink sees it once its batch is full
+   * or the stream is flushed.
+   */
+  void Write(std::string_view specific_request) {
+    batch_.Add(specific_request);
+    if (batch_.size() == batch_size_) {
+      Flush();
+    }
+  }
+
+  /**
+   * Adapts a whole range (or chunk) of adaptee outputs.
+   */
+  template <typename Iterator>
+  void Write(Iterator first, Iterator last) {
+    for (; first != last; ++first) {
+      Write(std::string_view(*first));
+    }
+  }
+
+  void Flush() {
+    if (batch_.size() > 0) {
+      sink_->Consume(batch_);
+      batch_.Clear();
+    }
+  }
+};
+
+/**
+ * An example sink that prints every record.
+ */
+class PrintingSink : public RecordSink {
+ public:
+  void Consume(const TranslatedBatch &batch) override {
+    std::cout << "Sink: a batch of " << batch.size() << " record(s)\n";
+    for (size_t i = 0; i < batch.size(); i++) {
+      std::cout << "  " << batch[i] << "\n";
+    }
   }
 };
 
@@ -47,6 +314,125 @@ class Adapter : public Target {
  */
 void ClientCode(const Target *target) { std::cout << target->Request(); }
 
+/**
+ * Sends the same request many times through both adapters.
+ */
+void BenchmarkRepeatedRequests(Adaptee *adaptee) {
+  const int kRequests = 2000000;
+  Adapter adapter(adaptee);
+  CachingAdapter caching_adapter(adaptee, 16, 1 << 20);
+  size_t length = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRequests; i++) {
+    length += adapter.Request().size();
+  }
+  std::chrono::duration<double> plain_time =
+      std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kRequests; i++) {
+    length += caching_adapter.Request().size();
+  }
+  std::chrono::duration<double> caching_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "Adapter:        " << kRequests / plain_time.count()
+            << " requests/s\n";
+  std::cout << "CachingAdapter: " << kRequests / caching_time.count()
+            << " requests/s, hit rate " << caching_adapter.hit_rate() << "\n";
+  std::cout << "(" << length << " bytes)\n";
+}
+
+/**
+ * Measures every supported kernel on payloads from 16 B to 16 MB, after
+ * checking that they all produce the same bytes.
+ */
+void BenchmarkReverseKernels() {
+  std::vector<NamedReverseKernel> kernels = SupportedReverseKernels();
+  std::cout << "Selected kernel: " << BestReverseKernel().name_ << "\n";
+  for (size_t size = 16; size <= (16 << 20); size *= 4) {
+    std::string payload(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+      payload[i] = static_cast<char>(i * 131 + 7);
+    }
+    std::string expected(size, '\0');
+    ReverseScalar(payload.data(), size, &expected[0]);
+    std::string out(size, '\0');
+
+    std::cout << size << " B:";
+    for (const NamedReverseKernel &kernel : kernels) {
+      kernel.kernel_(payload.data(), size, &out[0]);
+      if (out != expected) {
+        std::cout << " " << kernel.name_ << " is WRONG";
+        continue;
+      }
+      const size_t rounds = std::max<size_t>(1, (64 << 20) / size);
+      auto start = std::chrono::steady_clock::now();
+      for (size_t round = 0; round < rounds; round++) {
+        kernel.kernel_(payload.data(), size, &out[0]);
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      std::cout << " " << kernel.name_ << " "
+                << rounds * size / elapsed.count() / 1e9 << " GB/s";
+    }
+    std::cout << "\n";
+  }
+}
+
+/**
+ * A sink that only counts what it receives.
+ */
+class CountingSink : public RecordSink {
+ public:
+  size_t records_ = 0;
+  size_t bytes_ = 0;
+  void Consume(const TranslatedBatch &batch) override {
+    records_ += batch.size();
+    for (size_t i = 0; i < batch.size(); i++) {
+      bytes_ += batch[i].size();
+    }
+  }
+};
+
+/**
+ * Adapts a stream of adaptee records one at a time, with fresh buffers for
+ * every record, and then with the StreamingAdapter at several batch sizes.
+ */
+void BenchmarkStreaming(Adaptee *adaptee) {
+  const size_t kRecords = 1000000;
+  std::vector<std::string> records(kRecords, adaptee->SpecificRequest());
+
+  CountingSink single_sink;
+  RecordSink *sink = &single_sink;
+  auto start = std::chrono::steady_clock::now();
+  for (const std::string &record : records) {
+    TranslatedBatch single;
+    single.Add(record);
+    sink->Consume(single);
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  size_t bytes = single_sink.bytes_;
+  std::cout << "one record at a time: " << kRecords / elapsed.count()
+            << " records/s\n";
+
+  for (size_t batch_size : {1, 64, 1024}) {
+    CountingSink sink;
+    start = std::chrono::steady_clock::now();
+    {
+      StreamingAdapter streaming_adapter(&sink, batch_size);
+      streaming_adapter.Write(records.begin(), records.end());
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    bytes += sink.bytes_;
+    std::cout << "batches of " << batch_size << ": "
+              << kRecords / elapsed.count() << " records/s\n";
+  }
+  std::cout << "(" << bytes << " bytes)\n";
+}
+
 int main() {
   std::cout << "Client: I can work just fine with the Target objects:\n";
   Target *target = new Target;
@@ -60,8 +446,40 @@ int main() {
   std::cout << "Client: But I can work with it via the Adapter:\n";
   Adapter *adapter = new Adapter(adaptee);
   ClientCode(adapter);
+  std::cout << "\n\n";
+  std::cout << "Client: The CachingAdapter only translates the same output "
+               "once:\n";
+  CachingAdapter *caching_adapter = new CachingAdapter(adaptee, 16, 1 << 20);
+  ClientCode(caching_adapter);
+  std::cout << "\n";
+  ClientCode(caching_adapter);
+  std::cout << "\nCache hits: " << caching_adapter->hits()
+            << ", misses: " << caching_adapter->misses()
+            << ", bytes held: " << caching_adapter->bytes() << "\n\n";
+  delete caching_adapter;
+
+  std::cout << "Benchmark: repeated requests with and without the cache:\n";
+  BenchmarkRepeatedRequests(adaptee);
   std::cout << "\n";
 
+  std::cout << "Benchmark: reversing large adaptee payloads:\n";
+  BenchmarkReverseKernels();
+  std::cout << "\n";
+
+  std::cout << "Client: The StreamingAdapter adapts a stream of records in "
+               "batches:\n";
+  std::vector<std::string> records = {adaptee->SpecificRequest(), ".olleH",
+                                      ".dlroW"};
+  PrintingSink printing_sink;
+  {
+    StreamingAdapter streaming_adapter(&printing_sink, 2);
+    streaming_adapter.Write(records.begin(), records.end());
+  }
+  std::cout << "\n";
+
+  std::cout << "Benchmark: adapting a stream of records:\n";
+  BenchmarkStreaming(adaptee);
+
   delete target;
   delete adaptee;
   delete adapter;
@@ -1,5 +1,16 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BRIDGE_HAS_X86_KERNELS 1
+#endif
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <vector>
 /**
  * The Implementation defines the interface for all implementation classes. It
  * doesn't have to match the Abstraction's interface. In fact, the two
@@ -12,23 +23,47 @@ class Implementation {
  public:
   virtual ~Implementation() {}
   virtual std::string OperationImplementation() const = 0;
+  /**
+   * A cheap primitive operation, so that the cost of reaching it is not hidden
+   * behind building a string.
+   */
+  virtual int ValueImplementation(int input) const = 0;
+  /**
+   * The same primitive over a whole array. Implementations that can do better
+   * than one value at a time override it.
+   */
+  virtual void ValuesImplementation(const int* inputs, int* outputs,
+                                    size_t count) const {
+    for (size_t i = 0; i < count; i++) {
+      outputs[i] = ValueImplementation(inputs[i]);
+    }
+  }
 };
 
 /**
  * Each Concrete Implementation corresponds to a specific platform and
  * implements the Implementation interface using that platform's API.
+ *
+ * The value primitives compute in unsigned arithmetic, so that large inputs
+ * wrap around instead of overflowing a signed int.
  */
-class ConcreteImplementationA : public Implementation {
+class ConcreteImplementationA final : public Implementation {
  public:
   std::string OperationImplementation() const override {
     return "ConcreteImplementationA: Here's the result on the platform A.\n";
   }
+  int ValueImplementation(int input) const override {
+    return static_cast<int>(static_cast<unsigned>(input) * 3u + 1u);
+  }
 };
-class ConcreteImplementationB : public Implementation {
+class ConcreteImplementationB final : public Implementation {
  public:
   std::string OperationImplementation() const override {
     return "ConcreteImplementationB: Here's the result on the platform B.\n";
   }
+  int ValueImplementation(int input) const override {
+    return static_cast<int>(static_cast<unsigned>(input) * 5u + 2u);
+  }
 };
 
 /**
@@ -54,6 +89,18 @@ class Abstraction {
     return "Abstraction: Base operation with:\n" +
            implementation_->OperationImplementation();
   }
+
+  virtual int Value(int input) const {
+    unsigned value = implementation_->ValueImplementation(input);
+    return static_cast<int>(value + 1u);
+  }
+
+  virtual void Values(const int* inputs, int* outputs, size_t count) const {
+    implementation_->ValuesImplementation(inputs, outputs, count);
+    for (size_t i = 0; i < count; i++) {
+      outputs[i] = static_cast<int>(static_cast<unsigned>(outputs[i]) + 1u);
+    }
+  }
 };
 /**
  * You can extend the Abstraction without changing the Implementation classes.
@@ -66,6 +113,240 @@ class ExtendedAbstraction : public Abstraction {
     return "ExtendedAbstraction: Extended operation with:\n" +
            implementation_->OperationImplementation();
   }
+
+  int Value(int input) const override {
+    unsigned value = implementation_->ValueImplementation(input);
+    return static_cast<int>(value * 2u);
+  }
+
+  void Values(const int* inputs, int* outputs, size_t count) const override {
+    implementation_->ValuesImplementation(inputs, outputs, count);
+    for (size_t i = 0; i < count; i++) {
+      outputs[i] = static_cast<int>(static_cast<unsigned>(outputs[i]) * 2u);
+    }
+  }
+};
+
+/**
+ * Platforms aren't only operating systems: the same operation can have one
+ * implementation per instruction set. The CpuImplementation computes what
+ * ConcreteImplementationA does, with its array primitive backed by a kernel
+ * for one instruction set.
+ */
+using ValuesKernel = void (*)(const int* inputs, int* outputs, size_t count);
+
+void ValuesScalar(const int* inputs, int* outputs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    outputs[i] = static_cast<int>(static_cast<unsigned>(inputs[i]) * 3u + 1u);
+  }
+}
+
+#ifdef BRIDGE_HAS_X86_KERNELS
+__attribute__((target("sse4.2"))) void ValuesSse42(const int* inputs,
+                                                   int* outputs, size_t count) {
+  const __m128i three = _mm_set1_epi32(3);
+  const __m128i one = _mm_set1_epi32(1);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i values =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs + i));
+    values = _mm_add_epi32(_mm_mullo_epi32(values, three), one);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(outputs + i), values);
+  }
+  ValuesScalar(inputs + i, outputs + i, count - i);
+}
+
+__attribute__((target("avx2"))) void ValuesAvx2(const int* inputs,
+                                                int* outputs, size_t count) {
+  const __m256i three = _mm256_set1_epi32(3);
+  const __m256i one = _mm256_set1_epi32(1);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i values =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(inputs + i));
+    values = _mm256_add_epi32(_mm256_mullo_epi32(values, three), one);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(outputs + i), values);
+  }
+  ValuesScalar(inputs + i, outputs + i, count - i);
+}
+
+__attribute__((target("avx512f"))) void ValuesAvx512(const int* inputs,
+                                                     int* outputs,
+                                                     size_t count) {
+  const __m512i three = _mm512_set1_epi32(3);
+  const __m512i one = _mm512_set1_epi32(1);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i values = _mm512_loadu_si512(inputs + i);
+    values = _mm512_add_epi32(_mm512_mullo_epi32(values, three), one);
+    _mm512_storeu_si512(outputs + i, values);
+  }
+  ValuesScalar(inputs + i, outputs + i, count - i);
+}
+#endif
+
+class CpuImplementation final : public Implementation {
+ private:
+  const char* name_;
+  ValuesKernel kernel_;
+
+ public:
+  CpuImplementation(const char* name, ValuesKernel kernel)
+      : name_(name), kernel_(kernel) {}
+  const char* name() const { return name_; }
+
+  std::string OperationImplementation() const override {
+    return std::string("CpuImplementation: Here's the result on the ") +
+           name_ + " platform.\n";
+  }
+  int ValueImplementation(int input) const override {
+    int output;
+    kernel_(&input, &output, 1);
+    return output;
+  }
+  void ValuesImplementation(const int* inputs, int* outputs,
+                            size_t count) const override {
+    kernel_(inputs, outputs, count);
+  }
+};
+
+/**
+ * The CpuImplementationRegistry works like an ifunc resolver: the first time
+ * an implementation is asked for, it probes the CPU and settles on the fastest
+ * implementation the CPU supports. Setting the BRIDGE_IMPLEMENTATION
+ * environment variable to one of the names below forces that implementation
+ * instead, as long as the CPU supports it, which is handy for testing.
+ */
+class CpuImplementationRegistry {
+ private:
+  std::vector<CpuImplementation*> supported_;
+  CpuImplementation* selected_;
+
+  CpuImplementationRegistry() {
+#ifdef BRIDGE_HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      supported_.push_back(new CpuImplementation("avx512", &ValuesAvx512));
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      supported_.push_back(new CpuImplementation("avx2", &ValuesAvx2));
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      supported_.push_back(new CpuImplementation("sse4.2", &ValuesSse42));
+    }
+#endif
+    supported_.push_back(new CpuImplementation("scalar", &ValuesScalar));
+    selected_ = supported_.front();
+
+    if (const char* forced = std::getenv("BRIDGE_IMPLEMENTATION")) {
+      CpuImplementation* match = Find(forced);
+      if (match != nullptr) {
+        selected_ = match;
+      } else {
+        std::cerr << "BRIDGE_IMPLEMENTATION=" << forced
+                  << " is not supported on this CPU, using "
+                  << selected_->name() << "\n";
+      }
+    }
+  }
+
+  CpuImplementation* Find(const char* name) const {
+    for (CpuImplementation* implementation : supported_) {
+      if (std::strcmp(implementation->name(), name) == 0) {
+        return implementation;
+      }
+    }
+    return nullptr;
+  }
+
+ public:
+  ~CpuImplementationRegistry() {
+    for (CpuImplementation* implementation : supported_) {
+      delete implementation;
+    }
+  }
+
+  static CpuImplementationRegistry& Global() {
+    static CpuImplementationRegistry registry;
+    return registry;
+  }
+
+  /**
+   * The implementation every new Abstraction should be bound to.
+   */
+  CpuImplementation* Selected() const { return selected_; }
+
+  /**
+   * All implementations this CPU can run, fastest first.
+   */
+  const std::vector<CpuImplementation*>& Supported() const {
+    return supported_;
+  }
+
+  /**
+   * Runs every supported implementation on the same inputs and checks that
+   * they all agree with ConcreteImplementationA, the implementation they stand
+   * in for.
+   */
+  bool SelfTest() const {
+    std::vector<int> inputs(1000 + 13);
+    for (size_t i = 0; i < inputs.size(); i++) {
+      inputs[i] = static_cast<int>(i * 2654435761u);
+    }
+    std::vector<int> expected(inputs.size());
+    ConcreteImplementationA().ValuesImplementation(
+        inputs.data(), expected.data(), inputs.size());
+    bool passed = true;
+    for (CpuImplementation* implementation : supported_) {
+      std::vector<int> outputs(inputs.size());
+      implementation->ValuesImplementation(inputs.data(), outputs.data(),
+                                           inputs.size());
+      bool same = outputs == expected;
+      std::cout << "Self-test " << implementation->name() << ": "
+                << (same ? "OK" : "FAILED") << "\n";
+      passed = passed && same;
+    }
+    return passed;
+  }
+};
+
+/**
+ * When the pairing of abstraction and implementation is known at compile time,
+ * the bridge can be built from templates instead. The abstraction is still
+ * written only against the Implementation's operations, but it holds a
+ * concrete implementation by value, and the abstraction itself is picked
+ * statically, so neither layer needs a virtual call and both can be inlined.
+ */
+template <typename ConcreteImplementation>
+class StaticAbstraction {
+ protected:
+  ConcreteImplementation implementation_;
+
+ public:
+  std::string Operation() const {
+    return "Abstraction: Base operation with:\n" +
+           implementation_.OperationImplementation();
+  }
+
+  int Value(int input) const {
+    unsigned value = implementation_.ValueImplementation(input);
+    return static_cast<int>(value + 1u);
+  }
+};
+
+template <typename ConcreteImplementation>
+class StaticExtendedAbstraction
+    : public StaticAbstraction<ConcreteImplementation> {
+ public:
+  std::string Operation() const {
+    return "ExtendedAbstraction: Extended operation with:\n" +
+           this->implementation_.OperationImplementation();
+  }
+
+  int Value(int input) const {
+    unsigned value = this->implementation_.ValueImplementation(input);
+    return static_cast<int>(value * 2u);
+  }
 };
 
 /**
@@ -79,6 +360,55 @@ void ClientCode(const Abstraction& abstraction) {
   std::cout << abstraction.Operation();
   // ...
 }
+
+/**
+ * The client code of the static bridge is a template over the abstraction.
+ */
+template <typename StaticAbstractionType>
+void StaticClientCode(const StaticAbstractionType& abstraction) {
+  std::cout << abstraction.Operation();
+}
+
+/**
+ * Calls Value() in a tight loop through the virtual bridge and through the
+ * static one, for the same extended abstraction and implementation.
+ */
+void BenchmarkBridges(const Abstraction& abstraction) {
+  const int kIterations = 100000000;
+  // Inputs come from memory filled at runtime, so neither loop can be folded
+  // into a closed form by the compiler.
+  const int kInputs = 4096;
+  std::vector<int> inputs(kInputs);
+  uint32_t random = static_cast<uint32_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  for (int& input : inputs) {
+    random = random * 1664525u + 1013904223u;
+    input = static_cast<int>(random >> 8);
+  }
+  long long sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i++) {
+    sum += abstraction.Value(inputs[i % kInputs]);
+  }
+  std::chrono::duration<double> virtual_time =
+      std::chrono::steady_clock::now() - start;
+
+  StaticExtendedAbstraction<ConcreteImplementationB> static_abstraction;
+  long long static_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kIterations; i++) {
+    static_sum += static_abstraction.Value(inputs[i % kInputs]);
+  }
+  std::chrono::duration<double> static_time =
+      std::chrono::steady_clock::now() - start;
+
+  std::cout << "virtual bridge: " << virtual_time.count() * 1e9 / kIterations
+            << " ns/call\n";
+  std::cout << "static bridge:  " << static_time.count() * 1e9 / kIterations
+            << " ns/call\n";
+  std::cout << "(checksums " << sum << ", " << static_sum << ")\n";
+}
+
 /**
  * The client code should be able to work with any pre-configured abstraction-
  * implementation combination.
@@ -95,9 +425,33 @@ int main() {
   implementation = new ConcreteImplementationB;
   abstraction = new ExtendedAbstraction(implementation);
   ClientCode(*abstraction);
+  std::cout << std::endl;
+
+  StaticClientCode(StaticAbstraction<ConcreteImplementationA>());
+  std::cout << std::endl;
+  StaticClientCode(StaticExtendedAbstraction<ConcreteImplementationB>());
+  std::cout << std::endl;
+
+  std::cout << "Benchmark: virtual vs. static bridge:\n";
+  BenchmarkBridges(*abstraction);
 
   delete implementation;
   delete abstraction;
+  std::cout << std::endl;
+
+  CpuImplementationRegistry& registry = CpuImplementationRegistry::Global();
+  abstraction = new ExtendedAbstraction(registry.Selected());
+  ClientCode(*abstraction);
+  const int inputs[] = {1, 2, 3, 4, 5};
+  int outputs[5];
+  abstraction->Values(inputs, outputs, 5);
+  std::cout << "Values:";
+  for (int output : outputs) {
+    std::cout << " " << output;
+  }
+  std::cout << "\n";
+  delete abstraction;
+  bool passed = registry.SelfTest();
 
-  return 0;
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
 }
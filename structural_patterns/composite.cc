@@ -1,7 +1,22 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 /**
  * The base Component class declares common operations for both simple and
  * complex objects of a composition.
@@ -11,7 +26,37 @@ class Component {
    * @var Component
    */
  protected:
-  Component *parent_;
+  Component *parent_ = nullptr;
+  /**
+   * Set when the component computes its Value() or Operation() and cleared
+   * when something below it changes. A set flag means an ancestor may hold a
+   * result that depends on this component; a clear one means no ancestor does,
+   * since a composite only computes its result after its children.
+   *
+   * Plain composites set the flags too, so that an invalidation walk can pass
+   * through them to a caching ancestor. They are relaxed atomics because two
+   * threads may evaluate the same plain tree at once; the stores are
+   * idempotent and order nothing else.
+   */
+  mutable std::atomic<bool> value_valid_{false};
+  mutable std::atomic<bool> operation_valid_{false};
+
+  bool IsValid() const {
+    return value_valid_.load(std::memory_order_relaxed) ||
+           operation_valid_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Clears the value flags above a component whose value changed, stopping at
+   * the first clear one. Nothing is walked when no ancestor used the value.
+   */
+  void InvalidateValueAbove() {
+    for (Component *c = parent_;
+         c != nullptr && c->value_valid_.load(std::memory_order_relaxed);
+         c = c->parent_) {
+      c->value_valid_.store(false, std::memory_order_relaxed);
+    }
+  }
   /**
    * Optionally, the base Component can declare an interface for setting and
    * accessing a parent of the component in a tree structure. It can also
@@ -41,12 +86,41 @@ class Component {
   virtual bool IsComposite() const {
     return false;
   }
+  /**
+   * Tells the component that its results have changed. The component's own
+   * flags are always cleared, since a leaf never sets them; its ancestors are
+   * cleared up to the first ones that are already clear, so a change costs at
+   * most O(depth), and next to nothing when no ancestor has used the old
+   * results.
+   */
+  void Invalidate() {
+    value_valid_.store(false, std::memory_order_relaxed);
+    operation_valid_.store(false, std::memory_order_relaxed);
+    for (Component *c = parent_; c != nullptr && c->IsValid();
+         c = c->parent_) {
+      c->value_valid_.store(false, std::memory_order_relaxed);
+      c->operation_valid_.store(false, std::memory_order_relaxed);
+    }
+  }
   /**
    * The base Component may implement some default behavior or leave it to
    * concrete classes (by declaring the method containing the behavior as
    * "abstract").
    */
   virtual std::string Operation() const = 0;
+  /**
+   * Appends the result of Operation() to `out`. Composites render their whole
+   * subtree into the same buffer this way, so every byte of the output is
+   * written once no matter how deep the tree is.
+   */
+  virtual void AppendOperation(std::string &out) const {
+    out += Operation();
+  }
+  /**
+   * A numeric counterpart of Operation(): leaves carry a value and composites
+   * sum up their children.
+   */
+  virtual long Value() const = 0;
 };
 /**
  * The Leaf class represents the end objects of a composition. A leaf can't have
@@ -56,10 +130,22 @@ class Component {
  * objects only delegate to their sub-components.
  */
 class Leaf : public Component {
+ protected:
+  int value_ = 1;
+
  public:
   std::string Operation() const override {
     return "Leaf";
   }
+  long Value() const override {
+    return value_;
+  }
+  void SetValue(int value) {
+    if (value != value_) {
+      value_ = value;
+      InvalidateValueAbove();
+    }
+  }
 };
 /**
  * The Composite class represents the complex components that may have children.
@@ -81,6 +167,7 @@ class Composite : public Component {
   void Add(Component *component) override {
     this->children_.push_back(component);
     component->SetParent(this);
+    Invalidate();
   }
   /**
    * Have in mind that this method removes the pointer to the list but doesn't
@@ -90,10 +177,14 @@ class Composite : public Component {
   void Remove(Component *component) override {
     children_.remove(component);
     component->SetParent(nullptr);
+    Invalidate();
   }
   bool IsComposite() const override {
     return true;
   }
+  const std::list<Component *> &GetChildren() const {
+    return children_;
+  }
   /**
    * The Composite executes its primary logic in a particular way. It traverses
    * recursively through all its children, collecting and summing their results.
@@ -102,14 +193,497 @@ class Composite : public Component {
    */
   std::string Operation() const override {
     std::string result;
+    AppendOperation(result);
+    return result;
+  }
+  void AppendOperation(std::string &out) const override {
+    out += "Branch(";
+    const char *separator = "";
     for (const Component *c : children_) {
-      if (c == children_.back()) {
-        result += c->Operation();
+      out += separator;
+      c->AppendOperation(out);
+      separator = "+";
+    }
+    out += ")";
+    operation_valid_.store(true, std::memory_order_relaxed);
+  }
+  long Value() const override {
+    long sum = 0;
+    for (const Component *c : children_) {
+      sum += c->Value();
+    }
+    value_valid_.store(true, std::memory_order_relaxed);
+    return sum;
+  }
+};
+
+/**
+ * A Composite that remembers its results for as long as its flags stay set.
+ * Add and Remove clear both flags on the way up to the root, while
+ * Leaf::SetValue() only clears the value flags, since a leaf's Operation()
+ * doesn't depend on its value; other changes to a leaf go through
+ * Invalidate(). After a small edit only the composites on the path to the
+ * change are recomputed; the rest of the tree answers from cache.
+ *
+ * The caches are plain mutable members, so two threads must not evaluate the
+ * same CachingComposite at once.
+ */
+class CachingComposite : public Composite {
+ private:
+  mutable long value_ = 0;
+  mutable std::string operation_;
+
+  const std::string &CachedOperation() const {
+    if (!operation_valid_.load(std::memory_order_relaxed)) {
+      operation_.clear();
+      Composite::AppendOperation(operation_);
+    }
+    return operation_;
+  }
+
+ public:
+  std::string Operation() const override {
+    return CachedOperation();
+  }
+  void AppendOperation(std::string &out) const override {
+    out += CachedOperation();
+  }
+  long Value() const override {
+    if (!value_valid_.load(std::memory_order_relaxed)) {
+      value_ = Composite::Value();
+    }
+    return value_;
+  }
+};
+
+/**
+ * IsComposite() only says that a component has children, not that it is a
+ * Composite: a FlatComponent view answers true as well. Code that walks the
+ * children of a pointer tree goes through this function, which returns null
+ * for a leaf and throws std::invalid_argument for a composite-like component
+ * whose children aren't reachable through Composite::GetChildren().
+ */
+const Composite *AsComposite(const Component *component) {
+  if (!component->IsComposite()) {
+    return nullptr;
+  }
+  const Composite *composite = dynamic_cast<const Composite *>(component);
+  if (composite == nullptr) {
+    throw std::invalid_argument("component has no Composite children");
+  }
+  return composite;
+}
+
+/**
+ * Whether a composite's results are exactly the ones Composite computes from
+ * its children. Code that assembles those results itself, like FlatTree and
+ * ParallelTraversal, leaves other composites to their own methods.
+ */
+bool IsPlainComposite(const Composite *composite) {
+  const std::type_info &type = typeid(*composite);
+  return type == typeid(Composite) || type == typeid(CachingComposite);
+}
+
+/**
+ * A tree of separately allocated nodes linked through lists is slow to walk:
+ * nearly every step is a cache miss. The FlatTree stores the same tree in a
+ * few contiguous arrays, one entry per node in preorder. The subtree of node
+ * i is then the index range [i, i + subtree_size[i]), and its first child, if
+ * any, is i + 1; each further child follows right after the previous child's
+ * subtree.
+ *
+ * A FlatTree is built from an existing pointer-based tree and doesn't change
+ * afterwards. FlatComponent gives a Component view of any of its nodes.
+ *
+ * Operation() texts are taken from the source components: a leaf keeps the
+ * text its own Operation() returned. Only plain Composite and CachingComposite
+ * nodes are flattened and rendered from their children as "Branch(...)". Any
+ * other composite may compute its results differently, so it is stored as a
+ * single opaque node with its own Value() and Operation(), and its children
+ * are left out. Equal texts are stored once.
+ */
+class FlatComponent;
+
+class FlatTree {
+ private:
+  static constexpr uint32_t kBranch = UINT32_MAX;
+
+  std::vector<uint32_t> subtree_size_;
+  std::vector<uint8_t> is_composite_;
+  std::vector<long> value_;
+  std::vector<uint32_t> text_;
+  std::vector<std::string> texts_;
+  std::unordered_map<std::string, uint32_t> text_ids_;
+
+  uint32_t InternText(std::string text) {
+    auto inserted = text_ids_.emplace(text, texts_.size());
+    if (inserted.second) {
+      texts_.push_back(std::move(text));
+    }
+    return inserted.first->second;
+  }
+
+  void Append(const Component *component) {
+    size_t index = subtree_size_.size();
+    subtree_size_.push_back(1);
+    is_composite_.push_back(component->IsComposite());
+    value_.push_back(0);
+    text_.push_back(kBranch);
+    const Composite *composite = AsComposite(component);
+    if (composite != nullptr && IsPlainComposite(composite)) {
+      for (const Component *c : composite->GetChildren()) {
+        Append(c);
+      }
+      subtree_size_[index] =
+          static_cast<uint32_t>(subtree_size_.size() - index);
+    } else {
+      value_[index] = component->Value();
+      text_[index] = InternText(component->Operation());
+    }
+  }
+
+ public:
+  explicit FlatTree(const Component *root) {
+    Append(root);
+  }
+
+  size_t size() const {
+    return subtree_size_.size();
+  }
+  bool IsComposite(uint32_t index) const {
+    return is_composite_[index];
+  }
+
+  /**
+   * The sum of the leaf values in a subtree is a single scan over its range.
+   */
+  long Value(uint32_t index) const {
+    long sum = 0;
+    for (uint32_t i = index, end = index + subtree_size_[index]; i < end; i++) {
+      sum += value_[i];
+    }
+    return sum;
+  }
+
+  void AppendOperation(uint32_t index, std::string &out) const {
+    if (text_[index] != kBranch) {
+      out += texts_[text_[index]];
+      return;
+    }
+    out += "Branch(";
+    uint32_t end = index + subtree_size_[index];
+    for (uint32_t child = index + 1; child < end;
+         child += subtree_size_[child]) {
+      if (child != index + 1) {
+        out += "+";
+      }
+      AppendOperation(child, out);
+    }
+    out += ")";
+  }
+
+  FlatComponent Root() const;
+};
+
+class FlatComponent : public Component {
+ private:
+  const FlatTree *tree_;
+  uint32_t index_;
+
+ public:
+  FlatComponent(const FlatTree *tree, uint32_t index)
+      : tree_(tree), index_(index) {}
+  bool IsComposite() const override {
+    return tree_->IsComposite(index_);
+  }
+  std::string Operation() const override {
+    std::string result;
+    tree_->AppendOperation(index_, result);
+    return result;
+  }
+  void AppendOperation(std::string &out) const override {
+    tree_->AppendOperation(index_, out);
+  }
+  long Value() const override {
+    return tree_->Value(index_);
+  }
+};
+
+FlatComponent FlatTree::Root() const {
+  return FlatComponent(this, 0);
+}
+
+/**
+ * A thread pool for fork-join work. Every worker owns a deque of tasks: it
+ * pushes and pops its own tasks at the back, so it keeps working on the piece
+ * it split most recently, and when it runs dry it steals from the front of
+ * another worker's deque, where the oldest and largest pieces are.
+ *
+ * The thread that creates the pool counts as worker 0 and helps with the work
+ * while it waits for results, so a pool of one thread runs everything on the
+ * caller.
+ */
+class WorkStealingPool {
+ public:
+  using Task = std::function<void()>;
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+  struct Worker {
+    const WorkStealingPool *pool;
+    int index;
+  };
+  static thread_local Worker current_;
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> pending_{0};
+  std::atomic<int> sleeping_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  bool stop_ = false;
+
+  int Index() const {
+    return current_.pool == this ? current_.index : 0;
+  }
+
+  bool RunOne(int index) {
+    Task task;
+    int n = static_cast<int>(queues_.size());
+    for (int k = 0; k < n && !task; k++) {
+      Queue &queue = *queues_[(index + k) % n];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) {
+        continue;
+      }
+      if (k == 0) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
       } else {
-        result += c->Operation() + "+";
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+    }
+    if (!task) {
+      return false;
+    }
+    pending_.fetch_sub(1);
+    task();
+    return true;
+  }
+
+  void WorkerLoop(int index) {
+    current_ = {this, index};
+    while (true) {
+      if (RunOne(index)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      sleeping_.fetch_add(1);
+      wake_.wait(lock, [this] { return stop_ || pending_.load() > 0; });
+      sleeping_.fetch_sub(1);
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+ public:
+  explicit WorkStealingPool(int threads) {
+    for (int i = 0; i < std::max(threads, 1); i++) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    current_ = {this, 0};
+    for (int i = 1; i < threads; i++) {
+      threads_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+  }
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &thread : threads_) {
+      thread.join();
+    }
+    if (current_.pool == this) {
+      current_ = {nullptr, 0};
+    }
+  }
+  int size() const {
+    return static_cast<int>(queues_.size());
+  }
+
+  void Spawn(Task task) {
+    Queue &queue = *queues_[Index()];
+    // Count the task before publishing it: a thief may take it and decrement
+    // the count as soon as the queue lock is released.
+    pending_.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    if (sleeping_.load() > 0) {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      wake_.notify_one();
+    }
+  }
+  /**
+   * Runs pool tasks on the calling thread until `done()` returns true. This
+   * is how a task waits for the tasks it spawned without blocking a worker.
+   */
+  template <typename Done>
+  void HelpUntil(Done done) {
+    int index = Index();
+    while (!done()) {
+      if (!RunOne(index)) {
+        std::this_thread::yield();
       }
     }
-    return "Branch(" + result + ")";
+  }
+};
+
+thread_local WorkStealingPool::Worker WorkStealingPool::current_ = {nullptr,
+                                                                    0};
+
+/**
+ * Evaluates a component tree on a WorkStealingPool. A subtree of at most
+ * `grain` nodes isn't worth a task and runs the ordinary serial Operation() or
+ * Value(). Above that, a composite cuts its children into runs of about
+ * `grain` nodes, evaluates the first run itself and spawns the others. Every
+ * child writes into its own slot, and once all are done the slots are combined
+ * in child order, so the result is exactly the serial one.
+ *
+ * For Operation(), each serial subtree renders into a buffer of its own, and
+ * the levels above only pass these buffers up by move, adding the "Branch(",
+ * "+" and ")" around them. The buffers are copied once, into a single output
+ * string reserved at its final size.
+ *
+ * Subtree sizes come from a serial pre-pass that records them in preorder, the
+ * way FlatTree does. The tree must not change while the traversal is in use,
+ * and its composites must be Composite objects (see AsComposite()).
+ */
+class ParallelTraversal {
+ private:
+  WorkStealingPool *pool_;
+  const Component *root_;
+  size_t grain_;
+  std::vector<uint32_t> subtree_size_;
+
+  void CountNodes(const Component *component) {
+    size_t index = subtree_size_.size();
+    subtree_size_.push_back(1);
+    if (const Composite *composite = AsComposite(component)) {
+      for (const Component *c : composite->GetChildren()) {
+        CountNodes(c);
+      }
+      subtree_size_[index] =
+          static_cast<uint32_t>(subtree_size_.size() - index);
+    }
+  }
+
+  template <typename Result, typename Serial, typename Combine>
+  Result Evaluate(const Component *component, uint32_t index, Serial serial,
+                  Combine combine) const {
+    const Composite *composite = AsComposite(component);
+    if (composite == nullptr || subtree_size_[index] <= grain_ ||
+        !IsPlainComposite(composite)) {
+      return serial(component);
+    }
+    const std::list<Component *> &children = composite->GetChildren();
+    std::vector<const Component *> nodes(children.begin(), children.end());
+    std::vector<uint32_t> indices(nodes.size());
+    indices[0] = index + 1;
+    for (size_t i = 1; i < nodes.size(); i++) {
+      indices[i] = indices[i - 1] + subtree_size_[indices[i - 1]];
+    }
+    std::vector<Result> results(nodes.size());
+    auto evaluate_run = [&, serial, combine](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        results[i] = Evaluate<Result>(nodes[i], indices[i], serial, combine);
+      }
+    };
+    // Consecutive children that are small together become one task.
+    std::atomic<size_t> remaining(0);
+    size_t first_end = 0;
+    for (size_t begin = 0, end; begin < nodes.size(); begin = end) {
+      size_t run_size = subtree_size_[indices[begin]];
+      for (end = begin + 1; end < nodes.size(); end++) {
+        run_size += subtree_size_[indices[end]];
+        if (run_size > grain_) {
+          break;
+        }
+      }
+      if (begin == 0) {
+        first_end = end;
+        continue;
+      }
+      remaining.fetch_add(1, std::memory_order_relaxed);
+      pool_->Spawn([&evaluate_run, &remaining, begin, end] {
+        evaluate_run(begin, end);
+        remaining.fetch_sub(1, std::memory_order_release);
+      });
+    }
+    evaluate_run(0, first_end);
+    pool_->HelpUntil([&remaining] {
+      return remaining.load(std::memory_order_acquire) == 0;
+    });
+    return combine(results);
+  }
+
+ public:
+  ParallelTraversal(WorkStealingPool *pool, const Component *root,
+                    size_t grain)
+      : pool_(pool), root_(root), grain_(std::max<size_t>(grain, 1)) {
+    CountNodes(root);
+  }
+
+  std::string Operation() const {
+    using Pieces = std::vector<std::string>;
+    Pieces pieces = Evaluate<Pieces>(
+        root_, 0,
+        [](const Component *c) {
+          Pieces rendered(1);
+          c->AppendOperation(rendered[0]);
+          return rendered;
+        },
+        [](std::vector<Pieces> &results) {
+          Pieces combined(1, "Branch(");
+          for (size_t i = 0; i < results.size(); i++) {
+            if (i > 0) {
+              combined.back() += "+";
+            }
+            std::move(results[i].begin(), results[i].end(),
+                      std::back_inserter(combined));
+          }
+          combined.back() += ")";
+          return combined;
+        });
+    size_t size = 0;
+    for (const std::string &piece : pieces) {
+      size += piece.size();
+    }
+    std::string result;
+    result.reserve(size);
+    for (const std::string &piece : pieces) {
+      result += piece;
+    }
+    return result;
+  }
+  long Value() const {
+    return Evaluate<long>(
+        root_, 0, [](const Component *c) { return c->Value(); },
+        [](const std::vector<long> &results) {
+          long sum = 0;
+          for (long value : results) {
+            sum += value;
+          }
+          return sum;
+        });
   }
 };
 /**
@@ -135,6 +709,354 @@ void ClientCode2(Component *component1, Component *component2) {
   // ...
 }
 
+/**
+ * A leaf that stands in for leaves doing real work: every Value() call first
+ * runs `work` rounds of a small hash loop.
+ */
+class BusyLeaf : public Leaf {
+ private:
+  int work_;
+
+ public:
+  explicit BusyLeaf(int work) : work_(work) {}
+  long Value() const override {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < work_; i++) {
+      hash = (hash ^ static_cast<uint32_t>(i)) * 16777619u;
+    }
+    return value_ + (hash & 1);
+  }
+};
+
+/**
+ * A leaf whose Operation() text can change. Since the text isn't covered by
+ * SetValue(), a change goes through Invalidate().
+ */
+class LabelLeaf : public Leaf {
+ private:
+  std::string label_;
+
+ public:
+  explicit LabelLeaf(std::string label) : label_(std::move(label)) {}
+  std::string Operation() const override {
+    return label_;
+  }
+  void SetLabel(std::string label) {
+    label_ = std::move(label);
+    Invalidate();
+  }
+};
+
+/**
+ * A composite that computes its value differently from Composite.
+ */
+class ScaledComposite : public Composite {
+ public:
+  long Value() const override {
+    return 10 * Composite::Value();
+  }
+};
+
+Component *NewLeaf(int work) {
+  if (work > 0) {
+    return new BusyLeaf(work);
+  }
+  return new Leaf;
+}
+
+/**
+ * Builds a tree with `depth` levels of composites below the root, each having
+ * `fanout` children, and leaves at the bottom. A non-zero `work` makes the
+ * leaves BusyLeaf objects.
+ */
+template <typename CompositeType = Composite>
+Component *BuildTree(int depth, int fanout, int work = 0) {
+  if (depth == 0) {
+    return NewLeaf(work);
+  }
+  Component *composite = new CompositeType;
+  for (int i = 0; i < fanout; i++) {
+    composite->Add(BuildTree<CompositeType>(depth - 1, fanout, work));
+  }
+  return composite;
+}
+
+/**
+ * Collects the Leaf objects of a tree; other childless components are skipped.
+ */
+void CollectLeaves(Component *component, std::vector<Leaf *> &leaves) {
+  if (const Composite *composite = AsComposite(component)) {
+    for (Component *c : composite->GetChildren()) {
+      CollectLeaves(c, leaves);
+    }
+  } else if (Leaf *leaf = dynamic_cast<Leaf *>(component)) {
+    leaves.push_back(leaf);
+  }
+}
+
+/**
+ * Builds a maximally lopsided tree: a chain of `depth` composites, each with
+ * `fanout` leaves in front of the next composite.
+ */
+Component *BuildSkewedTree(int depth, int fanout, int work = 0) {
+  Component *root = new Composite;
+  Component *composite = root;
+  for (int level = 0; level < depth; level++) {
+    for (int i = 0; i < fanout; i++) {
+      composite->Add(NewLeaf(work));
+    }
+    Component *next = new Composite;
+    composite->Add(next);
+    composite = next;
+  }
+  composite->Add(NewLeaf(work));
+  return root;
+}
+
+void DeleteTree(Component *component) {
+  if (const Composite *composite = AsComposite(component)) {
+    for (Component *c : composite->GetChildren()) {
+      DeleteTree(c);
+    }
+  }
+  delete component;
+}
+
+/**
+ * Sums up a tree of about a million nodes through the pointer-based
+ * components and through its flat copy. Returns false if the flat copy of
+ * that tree, or of a small one with a ScaledComposite in it, gives different
+ * results.
+ */
+bool BenchmarkFlatTree() {
+  const int kRounds = 20;
+  Component *tree = BuildTree(6, 10);
+  FlatTree flat_tree(tree);
+  FlatComponent flat_root = flat_tree.Root();
+  const Component *views[] = {tree, &flat_root};
+  const char *names[] = {"pointer tree: ", "flat tree:    "};
+  long sums[2] = {0, 0};
+  for (int v = 0; v < 2; v++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < kRounds; round++) {
+      sums[v] += views[v]->Value();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << names[v] << elapsed.count() * 1e3 / kRounds << " ms per "
+              << flat_tree.size() << "-node traversal (sum "
+              << sums[v] / kRounds << ")\n";
+  }
+  DeleteTree(tree);
+
+  Component *mixed = new Composite;
+  Component *scaled = new ScaledComposite;
+  scaled->Add(new Leaf);
+  scaled->Add(new Leaf);
+  mixed->Add(scaled);
+  mixed->Add(new Leaf);
+  FlatTree flat_mixed(mixed);
+  FlatComponent flat_mixed_root = flat_mixed.Root();
+  bool ok = sums[0] == sums[1] &&
+            flat_mixed_root.Value() == mixed->Value() &&
+            flat_mixed_root.Operation() == mixed->Operation();
+  DeleteTree(mixed);
+  return ok;
+}
+
+/**
+ * Sums up a balanced and a skewed tree of about 100,000 busy leaves serially
+ * and on work-stealing pools of 1 up to as many threads as there are cores.
+ * Returns false if any parallel result differs from the serial one.
+ */
+bool BenchmarkParallelTraversal() {
+  const int kRounds = 5;
+  const size_t kGrain = 256;
+  const int kWork = 200;
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < cores; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(cores);
+
+  bool ok = true;
+  Component *trees[] = {BuildTree(5, 10, kWork),
+                        BuildSkewedTree(2000, 50, kWork)};
+  const char *names[] = {"balanced", "skewed  "};
+  for (int t = 0; t < 2; t++) {
+    auto start = std::chrono::steady_clock::now();
+    long expected = 0;
+    for (int round = 0; round < kRounds; round++) {
+      expected = trees[t]->Value();
+    }
+    std::chrono::duration<double> serial =
+        std::chrono::steady_clock::now() - start;
+    std::cout << names[t] << " serial:     " << serial.count() * 1e3 / kRounds
+              << " ms (sum " << expected << ")\n";
+    for (int threads : thread_counts) {
+      WorkStealingPool pool(threads);
+      ParallelTraversal traversal(&pool, trees[t], kGrain);
+      start = std::chrono::steady_clock::now();
+      for (int round = 0; round < kRounds; round++) {
+        ok = ok && traversal.Value() == expected;
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      std::cout << names[t] << " " << threads << " thread(s): "
+                << elapsed.count() * 1e3 / kRounds << " ms, speedup "
+                << serial.count() / elapsed.count() << "x\n";
+    }
+    DeleteTree(trees[t]);
+  }
+
+  Component *skewed = BuildSkewedTree(50, 3);
+  WorkStealingPool pool(std::max(cores, 2));
+  ok = ok && ParallelTraversal(&pool, skewed, 4).Operation() ==
+                 skewed->Operation();
+  DeleteTree(skewed);
+  return ok;
+}
+
+/**
+ * Changes one leaf of a million-node tree and evaluates the tree again, once
+ * with plain composites, which walk the whole tree, and once with caching
+ * composites, which only redo the path from the leaf to the root. Returns
+ * false if the two trees ever disagree.
+ */
+bool BenchmarkIncrementalEvaluation() {
+  const int kPlainRounds = 20;
+  const int kCachedRounds = 1000000;
+  Component *trees[] = {BuildTree<Composite>(6, 10),
+                        BuildTree<CachingComposite>(6, 10)};
+  const char *names[] = {"plain composites:   ", "caching composites: "};
+  const int rounds[] = {kPlainRounds, kCachedRounds};
+  std::vector<Leaf *> leaves[2];
+  long sums[2] = {0, 0};
+  for (int t = 0; t < 2; t++) {
+    CollectLeaves(trees[t], leaves[t]);
+    trees[t]->Value();
+    uint32_t random = 12345;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds[t]; round++) {
+      random = random * 1664525u + 1013904223u;
+      leaves[t][random % leaves[t].size()]->SetValue(round % 7);
+      sums[t] = trees[t]->Value();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << names[t] << elapsed.count() * 1e6 / rounds[t]
+              << " us per mutate + re-evaluate\n";
+  }
+
+  // Replay the cached rounds on the plain tree and compare, then check that
+  // structural edits reach the cached results as well.
+  uint32_t random = 12345;
+  for (int round = 0; round < kCachedRounds; round++) {
+    random = random * 1664525u + 1013904223u;
+    leaves[0][random % leaves[0].size()]->SetValue(round % 7);
+  }
+  bool ok = trees[0]->Value() == sums[1];
+
+  // A leaf's value doesn't show in Operation(), so editing one must not make
+  // the caching tree render its text again.
+  for (int t = 0; t < 2; t++) {
+    trees[t]->Operation();
+    leaves[t].front()->SetValue(42);
+    auto start = std::chrono::steady_clock::now();
+    size_t length = trees[t]->Operation().size();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << names[t] << elapsed.count() * 1e3
+              << " ms for Operation() after a leaf edit (" << length
+              << " bytes)\n";
+  }
+
+  Component *branches[2];
+  for (int t = 0; t < 2; t++) {
+    branches[t] = static_cast<Composite *>(trees[t])->GetChildren().front();
+    trees[t]->Remove(branches[t]);
+    trees[t]->Add(new Leaf);
+  }
+  ok = ok && trees[0]->Value() == trees[1]->Value() &&
+       trees[0]->Operation() == trees[1]->Operation();
+
+  // A leaf that changes its own text invalidates itself.
+  for (int t = 0; t < 2; t++) {
+    const std::list<Component *> &children =
+        static_cast<Composite *>(trees[t])->GetChildren();
+    LabelLeaf *label = new LabelLeaf("Old");
+    children.front()->Add(label);
+    trees[t]->Operation();
+    label->SetLabel("New");
+  }
+  ok = ok && trees[1]->Operation() == trees[0]->Operation() &&
+       trees[1]->Operation().find("New") != std::string::npos;
+  for (int t = 0; t < 2; t++) {
+    DeleteTree(branches[t]);
+    DeleteTree(trees[t]);
+  }
+  return ok;
+}
+
+/**
+ * How Composite::Operation() used to build its result: every level returns its
+ * own string, which the level above copies into a bigger one. A node at depth
+ * d is therefore copied d times, which is quadratic for deep trees.
+ */
+std::string NestedOperation(const Component *component) {
+  const Composite *composite = AsComposite(component);
+  if (composite == nullptr) {
+    return component->Operation();
+  }
+  const std::list<Component *> &children = composite->GetChildren();
+  std::string result;
+  for (const Component *c : children) {
+    if (c == children.back()) {
+      result += NestedOperation(c);
+    } else {
+      result += NestedOperation(c) + "+";
+    }
+  }
+  return "Branch(" + result + ")";
+}
+
+/**
+ * Renders balanced trees of growing size and chains of growing depth, both
+ * with nested strings and into a single buffer. With a single buffer the time
+ * per output byte stays flat. Returns false if the two renderings differ.
+ */
+bool BenchmarkRendering() {
+  bool ok = true;
+  auto measure = [&ok](const char *shape, int size, Component *tree) {
+    const int kRounds = 3;
+    double seconds[2];
+    std::string outputs[2];
+    for (int v = 0; v < 2; v++) {
+      auto start = std::chrono::steady_clock::now();
+      for (int round = 0; round < kRounds; round++) {
+        outputs[v] = v == 0 ? NestedOperation(tree) : tree->Operation();
+      }
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      seconds[v] = elapsed.count() / kRounds;
+    }
+    ok = ok && outputs[0] == outputs[1];
+    double bytes = static_cast<double>(outputs[1].size());
+    std::cout << shape << size << ": " << bytes / 1e6 << " MB, nested "
+              << seconds[0] * 1e9 / bytes << " ns/byte, single buffer "
+              << seconds[1] * 1e9 / bytes << " ns/byte\n";
+    DeleteTree(tree);
+  };
+  for (int depth = 3; depth <= 6; depth++) {
+    measure("balanced, depth ", depth, BuildTree(depth, 10));
+  }
+  for (int depth = 1000; depth <= 8000; depth *= 2) {
+    measure("chain, depth ", depth, BuildSkewedTree(depth, 1));
+  }
+  return ok;
+}
+
 /**
  * This way the client code can support the simple leaf components...
  */
@@ -166,8 +1088,37 @@ int main() {
 
   std::cout << "Client: I don't need to check the components classes even when managing the tree:\n";
   ClientCode2(tree, simple);
+  std::cout << "\n\n";
+
+  std::cout << "Client: The same tree flattened into contiguous storage:\n";
+  FlatTree flat_tree(tree);
+  FlatComponent flat_root = flat_tree.Root();
+  ClientCode(&flat_root);
+  std::cout << "\n\n";
+
+  std::cout << "Client: The same tree evaluated on a work-stealing pool:\n";
+  {
+    WorkStealingPool pool(2);
+    ParallelTraversal traversal(&pool, tree, 1);
+    std::cout << "RESULT: " << traversal.Operation();
+  }
+  std::cout << "\n\n";
+
+  std::cout << "Benchmark: traversing a pointer tree vs. a flat tree:\n";
+  bool flat_ok = BenchmarkFlatTree();
+  std::cout << "\n";
+
+  std::cout << "Benchmark: serial vs. parallel traversal:\n";
+  bool parallel_ok = BenchmarkParallelTraversal();
+  std::cout << "\n";
+
+  std::cout << "Benchmark: mutating one leaf and evaluating again:\n";
+  bool incremental_ok = BenchmarkIncrementalEvaluation();
   std::cout << "\n";
 
+  std::cout << "Benchmark: rendering Operation() of growing trees:\n";
+  bool rendering_ok = BenchmarkRendering();
+
   delete simple;
   delete tree;
   delete branch1;
@@ -176,5 +1127,5 @@ int main() {
   delete leaf_2;
   delete leaf_3;
 
-  return 0;
+  return flat_ok && parallel_ok && incremental_ok && rendering_ok ? 0 : 1;
 }
\ No newline at end of file